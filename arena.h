@@ -0,0 +1,104 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+
+/*
+ * Memory handed out in order from a few big blocks and given back all at
+ * once with reset(), for everything that lives exactly as long as one
+ * puzzle.
+ *
+ * reset() keeps the memory for the next puzzle. If the last one needed
+ * more than one block they are replaced by a single block of their total
+ * size, so after a few puzzles there is one block as big as the biggest
+ * puzzle so far and loading another one allocates nothing.
+ *
+ * Not thread safe, the memory handed out is zeroed.
+ */
+struct arena {
+    struct block {
+        uint8_t *data;
+        size_t size;
+    };
+    std::vector<block> blocks;
+    size_t used; // of the last block
+    size_t min_block_size;
+
+    arena() : used(0), min_block_size(1 << 20) {}
+    ~arena() { release(); }
+
+    void *alloc(size_t size, size_t align = 16) {
+        size_t offset = 0;
+        if (!blocks.empty()) {
+            offset = aligned(blocks.back(), used, align);
+        }
+        if (blocks.empty() || offset + size > blocks.back().size) {
+            size_t block_size = std::max(min_block_size, size + align);
+            if (!blocks.empty()) {
+                block_size = std::max(block_size, blocks.back().size * 2); // fewer blocks for big puzzles
+            }
+            add_block(block_size);
+            offset = aligned(blocks.back(), 0, align);
+        }
+        used = offset + size;
+        return blocks.back().data + offset;
+    }
+
+    template <typename T>
+    T *alloc_array(size_t n) {
+        return (T*)alloc(n * sizeof(T), alignof(T) > 16 ? alignof(T) : 16);
+    }
+
+    /* give back everything, the memory is kept for the next puzzle */
+    void reset() {
+        if (blocks.size() > 1) {
+            size_t size = capacity();
+            release();
+            add_block(size);
+        } else if (!blocks.empty()) {
+            memset(blocks[0].data, 0, used);
+        }
+        used = 0;
+    }
+
+    /* give back the memory itself */
+    void release() {
+        for (size_t i = 0; i < blocks.size(); i++) {
+            free(blocks[i].data);
+        }
+        blocks.clear();
+        used = 0;
+    }
+
+    size_t capacity() const {
+        size_t size = 0;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            size += blocks[i].size;
+        }
+        return size;
+    }
+
+    /* the first aligned offset in b from 'offset' on */
+    static size_t aligned(const block &b, size_t offset, size_t align) {
+        uintptr_t address = (uintptr_t)b.data + offset;
+        return offset + (align - address % align) % align;
+    }
+
+    void add_block(size_t size) {
+        block b;
+        b.size = size;
+        b.data = (uint8_t*)calloc(size, 1);
+        if (!b.data) {
+            abort();
+        }
+        blocks.push_back(b);
+    }
+};
+
+
+#endif // ARENA_H
@@ -0,0 +1,92 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <SDL2/SDL.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+
+/*
+ * Shelf packing of many small images into a few big ones (atlas pages).
+ *
+ * The rects are placed left to right in rows (shelves), tallest first, and a
+ * new page is started when a page would grow beyond max_w*max_h. 'padding'
+ * pixels are kept free around every rect so filtering does not bleed
+ * between neighbours.
+ */
+struct atlas_page {
+    int w;
+    int h;
+};
+
+/*
+ * Pack rects of size sizes[i].w x sizes[i].h. On return placement[i] holds
+ * the position (x, y, w, h) of rect i within page page_of[i], and 'pages'
+ * holds the size of every page used.
+ */
+void pack_atlas(const std::vector<SDL_Rect> &sizes,
+                int max_w, int max_h, int padding,
+                std::vector<SDL_Rect> &placement,
+                std::vector<int> &page_of,
+                std::vector<atlas_page> &pages) {
+    std::vector<int> order(sizes.size());
+    long long area = 0;
+    int widest = 0;
+    for (unsigned int i = 0; i < sizes.size(); i++) {
+        order[i] = i;
+        area += (long long)(sizes[i].w + padding) * (sizes[i].h + padding);
+        widest = std::max(widest, sizes[i].w + 2*padding);
+    }
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return sizes[a].h > sizes[b].h;
+    });
+
+    /* aim for roughly square pages, as narrow as the content allows */
+    int page_w = std::min(max_w, std::max(widest, (int)(sqrt((double)area) * 1.1) + 1));
+
+    placement.assign(sizes.size(), SDL_Rect());
+    page_of.assign(sizes.size(), 0);
+    pages.clear();
+    pages.push_back(atlas_page());
+    pages.back().w = page_w;
+    pages.back().h = 0;
+
+    int x = padding;
+    int y = padding;
+    int shelf_h = 0;
+
+    for (unsigned int k = 0; k < order.size(); k++) {
+        const SDL_Rect &size = sizes[order[k]];
+
+        if (x + size.w + padding > page_w) {
+            /* next shelf */
+            x = padding;
+            y += shelf_h + padding;
+            shelf_h = 0;
+        }
+        if (y + size.h + padding > max_h && y > padding) {
+            /* next page */
+            pages.push_back(atlas_page());
+            pages.back().w = page_w;
+            pages.back().h = 0;
+            x = padding;
+            y = padding;
+            shelf_h = 0;
+        }
+
+        SDL_Rect &r = placement[order[k]];
+        r.x = x;
+        r.y = y;
+        r.w = size.w;
+        r.h = size.h;
+        page_of[order[k]] = pages.size() - 1;
+
+        x += size.w + padding;
+        shelf_h = std::max(shelf_h, (int)size.h);
+        pages.back().h = std::max(pages.back().h, y + size.h + padding);
+    }
+}
+
+
+#endif // ATLAS_H
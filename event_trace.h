@@ -0,0 +1,160 @@
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+#include <SDL2/SDL.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "puzzle_cache.h"
+
+
+/*
+ * Input traces, see --record and --replay.
+ *
+ * A trace is a trace_header followed by one trace_event per event handled,
+ * in order. The header carries the key of the puzzle (photo, screen size,
+ * pieces and seed) so a replay plays the same puzzle. Only the fields the
+ * game looks at are kept, the events are rebuilt from them on replay.
+ */
+const char trace_magic[8] = {'P', 'P', 'U', 'Z', 'T', 'R', 'C', 'E'};
+const uint32_t trace_version = 1;
+
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    puzzle_cache_key key;
+};
+
+struct trace_event {
+    uint64_t time_ns; // since the first frame
+    uint32_t batch;   // events handled in the same pass of the main loop share it
+    uint32_t type;    // SDL_EventType
+    int32_t x;        // mouse position, motion and buttons
+    int32_t y;
+    int32_t code;     // button, key or window event
+    int32_t reserved;
+};
+
+inline trace_event trace_from_sdl(const SDL_Event &e, uint64_t time_ns, uint32_t batch) {
+    trace_event t;
+    memset(&t, 0, sizeof(t));
+    t.time_ns = time_ns;
+    t.batch = batch;
+    t.type = e.type;
+    switch (e.type) {
+    case SDL_MOUSEMOTION:
+        t.x = e.motion.x;
+        t.y = e.motion.y;
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        t.x = e.button.x;
+        t.y = e.button.y;
+        t.code = e.button.button;
+        break;
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        t.code = e.key.keysym.sym;
+        break;
+    case SDL_WINDOWEVENT:
+        t.code = e.window.event;
+        break;
+    default:
+        break;
+    }
+    return t;
+}
+
+inline SDL_Event trace_to_sdl(const trace_event &t) {
+    SDL_Event e;
+    memset(&e, 0, sizeof(e));
+    e.type = t.type;
+    switch (t.type) {
+    case SDL_MOUSEMOTION:
+        e.motion.x = t.x;
+        e.motion.y = t.y;
+        break;
+    case SDL_MOUSEBUTTONDOWN:
+    case SDL_MOUSEBUTTONUP:
+        e.button.x = t.x;
+        e.button.y = t.y;
+        e.button.button = t.code;
+        break;
+    case SDL_KEYDOWN:
+    case SDL_KEYUP:
+        e.key.keysym.sym = t.code;
+        break;
+    case SDL_WINDOWEVENT:
+        e.window.event = t.code;
+        break;
+    default:
+        break;
+    }
+    return e;
+}
+
+/*
+ * Appends events to a trace file, through the stdio buffer
+ */
+struct trace_writer {
+    FILE *f;
+
+    trace_writer() : f(0) {}
+
+    bool open(const char *filename, const puzzle_cache_key &key) {
+        trace_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, trace_magic, sizeof(h.magic));
+        h.version = trace_version;
+        h.key = key;
+        if ((f = fopen(filename, "wb")) == NULL || fwrite(&h, sizeof(h), 1, f) != 1) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void write(const trace_event &t) {
+        if (f) {
+            fwrite(&t, sizeof(t), 1, f);
+        }
+    }
+
+    void close() {
+        if (f) {
+            fclose(f);
+        }
+        f = 0;
+    }
+};
+
+/*
+ * Read a whole trace, false if it is not one. An incomplete last event is
+ * left out.
+ */
+bool read_trace(const char *filename, trace_header *h, std::vector<trace_event> &events) {
+    mapped_file f;
+    if (!f.open(filename)) {
+        return false;
+    }
+    bool ok = f.size >= sizeof(*h);
+    if (ok) {
+        memcpy(h, f.data, sizeof(*h));
+        ok = memcmp(h->magic, trace_magic, sizeof(h->magic)) == 0 && h->version == trace_version;
+    }
+    if (ok) {
+        size_t count = (f.size - sizeof(*h)) / sizeof(trace_event);
+        events.resize(count);
+        if (count > 0) {
+            memcpy(&events[0], f.data + sizeof(*h), count * sizeof(trace_event));
+        }
+    }
+    f.close();
+    return ok;
+}
+
+
+#endif // EVENT_TRACE_H
@@ -0,0 +1,236 @@
+#ifndef IMAGE_LOADER_H
+#define IMAGE_LOADER_H
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <algorithm>
+#include <vector>
+
+
+/*
+ * Area (box) filter, scales an image of src_w x src_h into the 32 bit
+ * surface 'dst', one source row at a time.
+ *
+ * Every destination pixel is the average of the source area it covers,
+ * source pixels only partly covered count with the covered fraction. Just
+ * one row of sums is kept, the source never needs to be in memory as a
+ * whole. Works for enlarging too, though that is not what it is meant for.
+ */
+struct area_scaler {
+    struct contribution {
+        int src;      // source column
+        int dst;      // destination column
+        float weight; // share of the destination pixel
+    };
+
+    SDL_Surface *dst;
+    int src_w;
+    int src_h;
+    int src_row;
+    int dst_row;
+    double dst_y; // how far the source rows added so far reach into the destination
+    std::vector<contribution> columns;
+    std::vector<float> row;  // current source row scaled horizontally, RGB
+    std::vector<float> sums; // destination row being summed up, RGB
+
+    area_scaler() : dst(0), src_w(0), src_h(0), src_row(0), dst_row(0), dst_y(0) {}
+
+    void init(int w, int h, SDL_Surface *destination) {
+        dst = destination;
+        src_w = w;
+        src_h = h;
+        src_row = 0;
+        dst_row = 0;
+        dst_y = 0;
+
+        double scale = (double)dst->w / src_w;
+        columns.clear();
+        for (int sx = 0; sx < src_w; sx++) {
+            double a = sx * scale;
+            double b = (sx + 1) * scale;
+            for (int dx = (int)a; dx < b && dx < dst->w; dx++) {
+                double overlap = std::min(b, dx + 1.0) - std::max(a, (double)dx);
+                if (overlap > 0) {
+                    contribution c = {sx, dx, (float)overlap};
+                    columns.push_back(c);
+                }
+            }
+        }
+        row.assign(dst->w * 3, 0);
+        sums.assign(dst->w * 3, 0);
+    }
+
+    /* next source row, 3 bytes (R, G, B) per pixel */
+    void add_row(const uint8_t *rgb) {
+        std::fill(row.begin(), row.end(), 0);
+        for (unsigned int i = 0; i < columns.size(); i++) {
+            const contribution &c = columns[i];
+            row[c.dst*3 + 0] += rgb[c.src*3 + 0] * c.weight;
+            row[c.dst*3 + 1] += rgb[c.src*3 + 1] * c.weight;
+            row[c.dst*3 + 2] += rgb[c.src*3 + 2] * c.weight;
+        }
+
+        src_row++;
+        double end = (double)src_row * dst->h / src_h;
+        while (dst_y < end - 1e-9 && dst_row < dst->h) {
+            double next = std::min(end, dst_row + 1.0);
+            float weight = next - dst_y;
+            for (unsigned int i = 0; i < sums.size(); i++) {
+                sums[i] += row[i] * weight;
+            }
+            dst_y = next;
+            if (dst_y > dst_row + 1.0 - 1e-6) {
+                emit_row();
+            }
+        }
+    }
+
+    /* call after the last source row */
+    void finish() {
+        while (dst_row < dst->h) {
+            emit_row(); // only left by rounding errors, if at all
+        }
+    }
+
+    void emit_row() {
+        Uint32 *out = (Uint32*)((uint8_t*)dst->pixels + (size_t)dst_row * dst->pitch);
+        for (int x = 0; x < dst->w; x++) {
+            out[x] = SDL_MapRGB(dst->format,
+                                std::min(255, (int)(sums[x*3 + 0] + 0.5f)),
+                                std::min(255, (int)(sums[x*3 + 1] + 0.5f)),
+                                std::min(255, (int)(sums[x*3 + 2] + 0.5f)));
+        }
+        std::fill(sums.begin(), sums.end(), 0);
+        dst_row++;
+    }
+};
+
+
+struct jpeg_error_jump {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jump;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo) {
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(((jpeg_error_jump*)cinfo->err)->jump, 1);
+}
+
+bool is_jpeg(const char *filename) {
+    unsigned char magic[3] = {0, 0, 0};
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        return false;
+    }
+    size_t n = fread(magic, 1, 3, f);
+    fclose(f);
+    return n == 3 && magic[0] == 0xff && magic[1] == 0xd8 && magic[2] == 0xff;
+}
+
+/*
+ * Decode a JPEG file straight into 'dst'. libjpeg already scales by 1/2,
+ * 1/4 or 1/8 while decoding (as long as the result is not smaller than
+ * 'dst'), the rest is done by the area filter one scanline at a time. So
+ * neither time nor memory grow much with the size of the photo.
+ */
+bool load_jpeg_scaled(const char *filename, SDL_Surface *dst) {
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error_jump err;
+    std::vector<uint8_t> line;
+    area_scaler scaler;
+
+    FILE *f = fopen(filename, "rb");
+    if (!f) {
+        return false;
+    }
+
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        fclose(f);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    for (unsigned int d = 8; d > 1; d /= 2) {
+        if (cinfo.image_width / d >= (unsigned int)dst->w && cinfo.image_height / d >= (unsigned int)dst->h) {
+            cinfo.scale_denom = d;
+            break;
+        }
+    }
+
+    jpeg_start_decompress(&cinfo);
+    line.resize(cinfo.output_width * 3);
+    scaler.init(cinfo.output_width, cinfo.output_height, dst);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW rows[1] = {&line[0]};
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        scaler.add_row(&line[0]);
+    }
+    scaler.finish();
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(f);
+    return true;
+}
+
+/*
+ * Load an image file into a new w x h surface with 32 bits per pixel and
+ * the given masks, scaled with the area filter. JPEG files are decoded
+ * scaled (see load_jpeg_scaled()), anything else is loaded with IMG_Load()
+ * first. Returns 0 if the file can't be read.
+ */
+SDL_Surface *load_image_scaled(const char *filename, int w, int h,
+                               Uint32 rmask, Uint32 gmask, Uint32 bmask, Uint32 amask) {
+    SDL_Surface *dst = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32, rmask, gmask, bmask, amask);
+    if (!dst) {
+        return 0;
+    }
+    if (is_jpeg(filename) && load_jpeg_scaled(filename, dst)) {
+        return dst;
+    }
+
+    SDL_Surface *src = IMG_Load(filename);
+    if (!src) {
+        SDL_FreeSurface(dst);
+        return 0;
+    }
+    if (SDL_ISPIXELFORMAT_INDEXED(src->format->format)) {
+        /* SDL_ConvertPixels() can't do palettes */
+        SDL_Surface *rgb = SDL_ConvertSurfaceFormat(src, SDL_PIXELFORMAT_RGB24, 0);
+        SDL_FreeSurface(src);
+        if (!(src = rgb)) {
+            SDL_FreeSurface(dst);
+            return 0;
+        }
+    }
+
+    std::vector<uint8_t> line(src->w * 3);
+    area_scaler scaler;
+    scaler.init(src->w, src->h, dst);
+    for (int y = 0; y < src->h; y++) {
+        SDL_ConvertPixels(src->w, 1,
+                          src->format->format, (uint8_t*)src->pixels + (size_t)y * src->pitch, src->pitch,
+                          SDL_PIXELFORMAT_RGB24, &line[0], src->w * 3);
+        scaler.add_row(&line[0]);
+    }
+    scaler.finish();
+
+    SDL_FreeSurface(src);
+    return dst;
+}
+
+
+#endif // IMAGE_LOADER_H
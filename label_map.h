@@ -0,0 +1,76 @@
+#ifndef LABEL_MAP_H
+#define LABEL_MAP_H
+
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+ * One label per pixel, stored row by row in a single buffer.
+ *
+ * The labels use the smallest unsigned type that can hold all of them
+ * (1, 2 or 4 bytes, picked when the map is created). The largest value of
+ * that type is reserved for 'none', i.e a pixel without a label.
+ *
+ * get()/set() work for any label size, loops over whole rows should use
+ * row<T>() with the matching type instead (see label_size).
+ */
+struct label_map {
+    int width;
+    int height;
+    int label_size; // bytes per label
+    uint32_t none;
+    uint8_t *labels;
+
+    label_map() : width(0), height(0), label_size(0), none(0), labels(0) {}
+
+    void create(int w, int h, uint32_t num_labels) {
+        destroy();
+        width = w;
+        height = h;
+        if (num_labels < 0xff) {
+            label_size = 1;
+            none = 0xff;
+        } else if (num_labels < 0xffff) {
+            label_size = 2;
+            none = 0xffff;
+        } else {
+            label_size = 4;
+            none = 0xffffffff;
+        }
+        labels = new uint8_t[(size_t)w * h * label_size];
+        memset(labels, 0xff, (size_t)w * h * label_size); // all 'none'
+    }
+
+    void destroy() {
+        delete [] labels;
+        labels = 0;
+        width = height = 0;
+    }
+
+    template <typename T>
+    T *row(int y) const {
+        return (T*)labels + (size_t)y * width;
+    }
+
+    uint32_t get(int x, int y) const {
+        size_t i = (size_t)y * width + x;
+        switch (label_size) {
+        case 1:  return labels[i];
+        case 2:  return ((uint16_t*)labels)[i];
+        default: return ((uint32_t*)labels)[i];
+        }
+    }
+
+    void set(int x, int y, uint32_t label) {
+        size_t i = (size_t)y * width + x;
+        switch (label_size) {
+        case 1:  labels[i] = label;              break;
+        case 2:  ((uint16_t*)labels)[i] = label; break;
+        default: ((uint32_t*)labels)[i] = label; break;
+        }
+    }
+};
+
+
+#endif // LABEL_MAP_H
@@ -7,9 +7,26 @@
 #include <time.h>
 #include <vector>
 #include <getopt.h>
-#include <list>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <sys/resource.h>
 
 #include "vec2.h"
+#include "label_map.h"
+#include "parallel.h"
+#include "atlas.h"
+#include "spatial_grid.h"
+#include "profiler.h"
+#include "image_loader.h"
+#include "puzzle_cache.h"
+#include "save_game.h"
+#include "random.h"
+#include "region_fill.h"
+#include "union_find.h"
+#include "event_trace.h"
+#include "arena.h"
 
 /*
  * To do:
@@ -41,20 +58,43 @@ struct piece {
   // current position (movable)
   SDL_Rect current_pos;
 
-  // clickable part of the surface, i.e will cover most of the piece
-  // so it should be good enough
-  SDL_Rect piece_area;
+  // the screen area covered by the (rotated) piece image, which is what the
+  // piece is listed under in piece_index
+  SDL_Rect indexed_area;
+
+  // index of the piece in piece_render_order, higher is drawn later (on top)
+  unsigned int z;
 
   int current_rotation;
 
+  // at correct_pos and not turned, i.e counted in pieces_correct
+  bool is_correct;
+
   int width;
   int height;
+
+  // the part of the width*height frame that the piece really covers,
+  // i.e the size of 'surface' and where it goes within the frame
+  SDL_Rect image_rect;
+
+  // one bit per pixel of image_rect, set where the pixel belongs to the piece,
+  // used for picking the piece with the mouse (see piece_hit())
+  uint8_t *hit_mask;  // in puzzle_arena
+  int hit_mask_pitch; // bytes per row
   
   int piece_idx_x;
   int piece_idx_y;
 
   SDL_Surface *surface;
+
+  // the image is at atlas_rect in the atlas page 'texture', shared with other pieces
+  int atlas_page;
+  SDL_Rect atlas_rect;
   SDL_Texture *texture;
+
+  // the image is there (extracted and uploaded), see take_loaded_pieces(),
+  // until then the piece is neither drawn nor in piece_index
+  bool loaded;
 };
 
 
@@ -62,16 +102,65 @@ SDL_Window *sdlWindow;
 SDL_Renderer *sdlRenderer;
 
 bool running = true;
-const char * photo_filename = 0;
+Uint32 loader_event = (Uint32)-1; // wakes up the main loop, see hand_over(). There is none without a window
+bool scene_dirty = true; // something changed since the last frame, render() is due
+bool static_layer_dirty = true; // the cached layer below the held piece changed, see render()
+
+/* profiler, see profile_frame_done() */
+enum { STAGE_EVENTS, STAGE_LOOP, STAGE_RENDER, STAGE_FRAME, STAGES };
+const char *stage_names[STAGES] = {"events", "loop", "render", "frame"};
+
+rolling_stats stage_stats[STAGES];
+rolling_stats event_stats;
+rolling_stats draw_call_stats;
+uint64_t stage_ns[STAGES]; // of the frame being prepared
+int frame_events = 0;
+int draw_calls = 0;
+long texture_bytes = 0; // all textures created so far
+int profiled_frames = 0;
+FILE *profile_out = 0;
+
+TTF_Font *hud_font = 0;
+SDL_Texture *hud_texture = 0;
+SDL_Rect hud_rect;
+uint64_t hud_updated = 0; // the text is updated twice a second at most
+
+const char * photo_filename = 0; // of the puzzle being played, one of photo_filenames
+std::vector<const char*> photo_filenames; // all given, N goes on to the next one
+unsigned int photo_index = 0;
 SDL_Surface *photo = 0;
 
 SDL_Point mouseposition;
-piece *piece_held_by_mouse;
-std::list<piece*> piece_render_order;
+piece *piece_held_by_mouse; // the piece picked up, its group (see held_group) is dragged along
+/*
+ * Pieces in render order, bottom first. Raising a piece appends it and
+ * leaves its old entry behind as stale (the z of the piece no longer points
+ * to it), stale entries are dropped once they make up half of the vector.
+ */
+std::vector<piece*> piece_render_order;
 
-SDL_Surface *piece_hint_map;
-SDL_Texture *piece_hint_map_txt;
-SDL_Rect piece_hint_rect;
+int pieces_correct = 0; // number of pieces with is_correct set
+
+spatial_grid<piece*> piece_index; // pieces by screen position, for finding the piece under the mouse
+
+std::vector<atlas_page> atlas_pages;
+std::vector<SDL_Texture*> atlas_textures;
+
+/*
+ * The hint: the curve of every edge as a polyline in board coordinates, see
+ * collect_hint_outline(). The polyline of edge i is hint_points[hint_lines[i]]
+ * up to hint_points[hint_lines[i+1]]. The points are in 1/hint_subpixels
+ * pixels, 32 bits so boards of any size fit.
+ */
+struct hint_point {
+  int32_t x, y;
+};
+const int hint_subpixels = 4;
+
+std::vector<hint_point> hint_points;
+std::vector<int> hint_lines;
+SDL_Rect piece_hint_rect; // the board on screen, the hint is drawn relative to it
+bool hint_taken = false;  // from the loader, see take_loaded_pieces()
 
 int piecewidth = -1; // width per piece
 int pieceheight = -1;
@@ -79,20 +168,32 @@ SDL_Point puzzlearea[5];
 
 SDL_Color bgcolor         = {.r=0x40, .g=0x00, .b=0x30, .a=0xff};
 SDL_Color puzzleareacolor = {.r=0x30, .g=0x30, .b=0x70, .a=0xff};
+SDL_Color hintcolor       = {.r=0xff, .g=0xff, .b=0xff, .a=0xff};
 
 float boardsize_percent = 0.5; // board size in percent of screen_width/height
 
 /*
- * piece_map as an int will probably not suffice when more than 3*3 pieces are used, say 2*10 or so, the math breaks for getting the indices (I think)
+ * The pieces, their pixels and hit masks come from puzzle_arena and go
+ * away together in unload_puzzle(), along with everything else made for
+ * the puzzle
  */
+arena puzzle_arena;
+piece **pieces = 0;  // one struct per puzzle piece, pieces[x][y]
+label_map piece_map; // one label per pixel in the puzzle, the index of the piece it belongs to, see piece_label()
 
-piece **pieces = 0;  // one struct per puzzle piece
-int **piece_map = 0; // one int per pixel in the puzzle, indicating indices for the 'pieces' matrix (x*pieces_x + y)
+mapped_file puzzle_cache_file; // the piece surfaces point into it after read_puzzle_cache()
+puzzle_cache_key puzzle_key; // of the puzzle being played, set when it is cached or saved
 
 
 // settable by parameters:
 int fullscreen_flag = 0;
 int show_hint_flag = 0;
+int smooth_hint_flag = 0; // anti-aliased hint outline
+int bench_flag = 0; // build the puzzle without a window, print stage timings and quit
+int fps_limit = 0; // frames per second while something moves, 0 = follow the display (vsync)
+int hud_flag = 0; // show the profiler overlay, toggled with F3
+char *profile_out_filename = 0; // write the profile of every frame to this csv file
+const char *hud_font_filename = "/usr/share/fonts/truetype/dejavu/DejaVuSansMono.ttf";
 int screen_width = 1280;
 int screen_height = 1024;
 int width = -1; // board size
@@ -100,6 +201,13 @@ int height = -1;
 int pieces_x = 3;
 int pieces_y = 3;
 int auto_correct_distance = 5; // how close the piece need be to "jump" into correct position
+unsigned int seed = 0; // for the edges and the start positions, from the clock unless given
+bool seed_given = false; // only puzzles with a given seed are cached, see read_puzzle_cache()
+int no_cache_flag = 0;
+std::string puzzle_cache_dir = default_puzzle_cache_dir();
+char *save_filename = 0; // restore the game from this file and keep saving it there
+char *record_filename = 0; // write the events handled to this trace
+char *replay_filename = 0; // play the events of this trace instead of the input
 
 #if SDL_BYTEORDER == SDL_BIG_ENDIAN
 const uint32_t rmask = 0xff000000;
@@ -114,16 +222,63 @@ const uint32_t amask = 0xff000000;
 #endif
 
 
+/*
+ * The label in piece_map for piece x,y in the 'pieces' matrix
+ */
+uint32_t piece_label(int x, int y){
+  return (uint32_t)y*pieces_x + x;
+}
+
+piece* label_to_piece(uint32_t label){
+  return &pieces[ label%pieces_x ][ label/pieces_x ];
+}
+
 piece* xy_to_piece(int x, int y){
-  return &pieces[ piece_map[x][y]%pieces_x ][ piece_map[x][y]/pieces_x ];
+  return label_to_piece(piece_map.get(x, y));
+}
+
+/*
+ * Where to draw the piece image, the rotation is around the center of the
+ * piece frame (current_pos), given relative to 'dest'
+ */
+void piece_image_dest(const piece * const p, SDL_Rect *dest, SDL_Point *center){
+  dest->x = p->current_pos.x + p->image_rect.x;
+  dest->y = p->current_pos.y + p->image_rect.y;
+  dest->w = p->image_rect.w;
+  dest->h = p->image_rect.h;
+  center->x = p->current_pos.w/2 - p->image_rect.x;
+  center->y = p->current_pos.h/2 - p->image_rect.y;
 }
 
 
 
 
+void change_puzzle(int photo_step, int more_pieces);
+bool puzzle_changed = false;   // the puzzle is not the one started with
+unsigned int failed_loads = 0; // photos skipped in a row, see take_loaded_pieces()
+const int min_piece_size = 8;  // pixels, + makes no smaller pieces
+
 void handle_keypress( SDL_Event *e){
-  if (e->key.keysym.sym == SDLK_ESCAPE){
+  switch (e->key.keysym.sym){
+  case SDLK_ESCAPE:
     running = false;
+    break;
+  case SDLK_F3:
+    hud_flag = !hud_flag;
+    scene_dirty = true;
+    break;
+  case SDLK_n:
+    change_puzzle(1, 0);
+    break;
+  case SDLK_PLUS:
+  case SDLK_EQUALS:
+  case SDLK_KP_PLUS:
+    change_puzzle(0, 1);
+    break;
+  case SDLK_MINUS:
+  case SDLK_KP_MINUS:
+    change_puzzle(0, -1);
+    break;
   }
 }
 
@@ -144,259 +299,2659 @@ bool pointInRect(const SDL_Point * const p, const SDL_Rect * const r){
          (r->y + r->h > p->y);
 
 }
+/*
+ * Share of the pieces in their correct place, 0..1
+ */
+float puzzle_progress(){
+  return (float)pieces_correct / (pieces_x*pieces_y);
+}
+
+void show_progress(){
+  if (sdlWindow){
+    char title[64];
+    snprintf(title, sizeof(title), "Photo Puzzle - %d of %d pieces placed", pieces_correct, pieces_x*pieces_y);
+    SDL_SetWindowTitle(sdlWindow, title);
+  }
+}
+
+/*
+ * Call whenever a piece has moved or turned, keeps pieces_correct up to date
+ */
+void update_piece_correct(piece *p){
+  int dx = p->current_pos.x - p->correct_pos.x;
+  int dy = p->current_pos.y - p->correct_pos.y;
+  bool correct = dx*dx + dy*dy < 2*2 && p->current_rotation == 0; // distance() <= 1
+
+  if (correct == p->is_correct){
+    return;
+  }
+  p->is_correct = correct;
+  pieces_correct += correct ? 1 : -1;
+  show_progress();
+
+  if (pieces_correct == pieces_x*pieces_y){
+    printf("Congratulations, puzzle is finished!\n");
+  }
+}
+
 void handle_right_mousebuttonup(SDL_Event *e){
 
 }
 
-void handle_right_mousebuttondown(SDL_Event *e){
+/*
+ * Drop the stale entries from piece_render_order, keeping the order
+ */
+void compact_render_order(){
+  unsigned int n = 0;
+  for (unsigned int i=0; i<piece_render_order.size(); i++){
+    piece *p = piece_render_order[i];
+    if (p->z == i){
+      p->z = n;
+      piece_render_order[n++] = p;
+    }
+  }
+  piece_render_order.resize(n);
+}
 
-  /* TODO: loop through piece_render_order instead and rotate only top one */
-  for (int i=0; i<pieces_x; i++){
-    for(int j=0; j<pieces_y; j++){
-      if (pointInRect(&mouseposition, &pieces[i][j].piece_area)){
-        pieces[i][j].current_rotation += 90;
-        pieces[i][j].current_rotation %= 360;
+/*
+ * Put the piece on top of all others
+ */
+void raise_piece(piece *p){
+  p->z = piece_render_order.size();
+  piece_render_order.push_back(p);
+
+  if (piece_render_order.size() >= 2*(unsigned int)(pieces_x*pieces_y)){
+    compact_render_order();
+  }
+}
+
+/*
+ * Screen area covered by the piece image, taking the rotation into account
+ */
+SDL_Rect piece_screen_area(const piece * const p){
+  SDL_Rect dest;
+  SDL_Point center;
+  SDL_Rect area;
+
+  piece_image_dest(p, &dest, &center);
+  if (p->current_rotation == 90 || p->current_rotation == 270){
+    // the image is turned around the frame center
+    area.x = dest.x + center.x - (dest.h - center.y);
+    area.y = dest.y + center.y - center.x;
+    area.w = dest.h;
+    area.h = dest.w;
+    if (p->current_rotation == 270){
+      area.x = dest.x + center.x - center.y;
+      area.y = dest.y + center.y - (dest.w - center.x);
+    }
+  }else if (p->current_rotation == 180){
+    area.x = dest.x + center.x - (dest.w - center.x);
+    area.y = dest.y + center.y - (dest.h - center.y);
+    area.w = dest.w;
+    area.h = dest.h;
+  }else{
+    area = dest;
+  }
+  return area;
+}
+
+/*
+ * Is the screen point pos on the piece? The point is turned back by the
+ * rotation of the piece and looked up in the hit mask.
+ */
+bool piece_hit(const piece * const p, const SDL_Point * const pos){
+  // relative to the rotation center (the center of the frame), using pixel centers
+  float dx = pos->x + 0.5f - (p->current_pos.x + p->current_pos.w/2);
+  float dy = pos->y + 0.5f - (p->current_pos.y + p->current_pos.h/2);
+  float ux, uy;
+
+  switch(p->current_rotation){
+  case 90:  ux =  dy; uy = -dx; break;
+  case 180: ux = -dx; uy = -dy; break;
+  case 270: ux = -dy; uy =  dx; break;
+  default:  ux =  dx; uy =  dy; break;
+  }
+
+  int mx = floorf(ux + p->current_pos.w/2 - p->image_rect.x);
+  int my = floorf(uy + p->current_pos.h/2 - p->image_rect.y);
+  if (mx < 0 || mx >= p->image_rect.w || my < 0 || my >= p->image_rect.h){
+    return false;
+  }
+  return p->hit_mask[my*p->hit_mask_pitch + mx/8] & (1 << (mx%8));
+}
+
+/*
+ * The topmost piece at point pos, or 0 if there is none
+ */
+piece* piece_at(const SDL_Point * const pos){
+  const std::vector<piece*> &candidates = piece_index.at(pos->x, pos->y);
+  piece *top = 0;
+
+  for (unsigned int i=0; i<candidates.size(); i++){
+    piece *p = candidates[i];
+    if ((top == 0 || p->z > top->z) && piece_hit(p, pos)){
+      top = p;
+    }
+  }
+  return top;
+}
+
+/*
+ * Put the piece in piece_index, or move it there after the piece has moved or turned
+ */
+void index_piece(piece *p){
+  p->indexed_area = piece_screen_area(p);
+  piece_index.insert(p, p->indexed_area);
+}
+
+void reindex_piece(piece *p){
+  if (!p->loaded){
+    return; // indexed once it is loaded
+  }
+  SDL_Rect area = piece_screen_area(p);
+  piece_index.move(p, p->indexed_area, area);
+  p->indexed_area = area;
+}
+
+/*
+ * Piece groups
+ *
+ * Grid neighbours lying at their correct offset from each other, turned
+ * the same way, are joined into a group that is moved and turned as a
+ * whole. The groups are kept in a union_find over the piece labels, the
+ * members of a group are listed at its root.
+ *
+ * While a group is dragged only held_offset changes, the pieces are moved
+ * (and indexed) when the group is put down. Groups of at least
+ * group_texture_min_pieces are drawn from a texture of their own, see
+ * update_group_textures().
+ */
+struct piece_group {
+  std::vector<piece*> members; // at the root only
+  std::vector<piece*> border;  // the members with a grid neighbour outside the group, at the root only
+  SDL_Rect area;               // screen area of the members, the area 'texture' shows
+  SDL_Texture *texture;
+  bool texture_dirty;          // listed in dirty_groups
+  unsigned int drawn;          // the draw_scene() pass it was drawn in last
+};
+
+const unsigned int group_texture_min_pieces = 16;
+
+union_find piece_groups;
+std::vector<piece_group> groups; // by piece label, used at the roots
+std::vector<int> dirty_groups;   // roots whose texture is due, may be stale
+
+piece_group *held_group = 0; // the group of piece_held_by_mouse
+SDL_Point held_offset;       // how far it has been dragged
+
+piece_group* group_of(const piece * const p){
+  return &groups[piece_groups.find(piece_label(p->piece_idx_x, p->piece_idx_y))];
+}
+
+void init_groups(){
+  const int num_pieces = pieces_x*pieces_y;
+  piece_groups.init(num_pieces);
+  groups.assign(num_pieces, piece_group());
+  for (int i=0; i<num_pieces; i++){
+    groups[i].members.push_back(label_to_piece(i));
+    groups[i].border.push_back(label_to_piece(i));
+    groups[i].texture = 0;
+    groups[i].texture_dirty = false;
+    groups[i].drawn = 0;
+  }
+}
+
+void group_texture_due(piece_group *g){
+  if (!g->texture_dirty && g->members.size() >= group_texture_min_pieces){
+    g->texture_dirty = true;
+    dirty_groups.push_back(g - &groups[0]);
+  }
+}
+
+SDL_Rect group_screen_area(const piece_group * const g){
+  SDL_Rect area = piece_screen_area(g->members[0]);
+  for (unsigned int i=1; i<g->members.size(); i++){
+    SDL_Rect r = piece_screen_area(g->members[i]);
+    SDL_UnionRect(&area, &r, &area);
+  }
+  return area;
+}
+
+/*
+ * Where b is relative to a in the finished puzzle, turned like a
+ */
+SDL_Point fit_offset(const piece * const a, const piece * const b){
+  SDL_Point d = {b->correct_pos.x - a->correct_pos.x, b->correct_pos.y - a->correct_pos.y};
+  for (int r=0; r<a->current_rotation; r+=90){
+    int t = d.x; // turned clockwise on the screen
+    d.x = -d.y;
+    d.y = t;
+  }
+  return d;
+}
+
+/*
+ * Do a and b lie (and are turned) as in the finished puzzle?
+ */
+bool pieces_fit(const piece * const a, const piece * const b){
+  if (a->current_rotation != b->current_rotation){
+    return false;
+  }
+  SDL_Point d = fit_offset(a, b);
+  return b->current_pos.x - a->current_pos.x == d.x &&
+         b->current_pos.y - a->current_pos.y == d.y;
+}
+
+bool lower_z(const piece * const a, const piece * const b){
+  return a->z < b->z;
+}
+
+/*
+ * Put the members of g on top of all others, keeping their order, so the
+ * group covers one z range and is drawn and picked as a whole
+ */
+void raise_group(piece_group *g){
+  std::vector<piece*> members = g->members;
+  std::sort(members.begin(), members.end(), lower_z);
+  for (unsigned int i=0; i<members.size(); i++){
+    raise_piece(members[i]);
+  }
+}
+
+/*
+ * Does p have a grid neighbour outside of the group 'root'?
+ */
+bool on_group_border(const piece * const p, int root){
+  const int dirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  for (int d=0; d<4; d++){
+    int x = p->piece_idx_x + dirs[d][0];
+    int y = p->piece_idx_y + dirs[d][1];
+    if (x >= 0 && x < pieces_x && y >= 0 && y < pieces_y &&
+        piece_groups.find(piece_label(x, y)) != root){
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Merge the groups of a and b, the members of the smaller one move over.
+ * Returns the merged group, or 0 if they were in one group already.
+ */
+piece_group* merge_groups(piece *a, piece *b){
+  piece_group *ga = group_of(a);
+  piece_group *gb = group_of(b);
+  if (ga == gb){
+    return 0;
+  }
+  piece_group *g = &groups[piece_groups.join(ga - &groups[0], gb - &groups[0])];
+  piece_group *other = g == ga ? gb : ga;
+
+  g->members.insert(g->members.end(), other->members.begin(), other->members.end());
+  std::vector<piece*>().swap(other->members);
+
+  // only the border of both parts can still be on the border
+  const int root = g - &groups[0];
+  g->border.insert(g->border.end(), other->border.begin(), other->border.end());
+  std::vector<piece*>().swap(other->border);
+  unsigned int n = 0;
+  for (unsigned int i=0; i<g->border.size(); i++){
+    if (on_group_border(g->border[i], root)){
+      g->border[n++] = g->border[i];
+    }
+  }
+  g->border.resize(n);
+  if (other->texture){
+    SDL_DestroyTexture(other->texture);
+    texture_bytes -= (long)other->area.w*other->area.h*4;
+    other->texture = 0;
+  }
+  other->texture_dirty = false;
+  if (held_group == other){
+    held_group = g;
+  }
+  group_texture_due(g);
+  return g;
+}
+
+/*
+ * Merge the groups of a and b and raise the result
+ */
+void join_groups(piece *a, piece *b){
+  piece_group *g = merge_groups(a, b);
+  if (g){
+    raise_group(g);
+  }
+}
+
+/*
+ * Join the group of p with every grid neighbour of its members that fits
+ */
+void join_neighbours(piece *p){
+  const int dirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  std::vector<piece*> members = group_of(p)->members; // changes while joining
+
+  for (unsigned int i=0; i<members.size(); i++){
+    piece *m = members[i];
+    for (int d=0; d<4; d++){
+      int x = m->piece_idx_x + dirs[d][0];
+      int y = m->piece_idx_y + dirs[d][1];
+      if (x >= 0 && x < pieces_x && y >= 0 && y < pieces_y && pieces_fit(m, &pieces[x][y])){
+        join_groups(m, &pieces[x][y]);
       }
     }
   }
 }
 
-void handle_left_mousebuttonup(SDL_Event *e){
-  piece_held_by_mouse = 0;
+bool lower_top_z(const piece_group * const a, const piece_group * const b){
+  return (*std::max_element(a->members.begin(), a->members.end(), lower_z))->z <
+         (*std::max_element(b->members.begin(), b->members.end(), lower_z))->z;
 }
 
-void handle_left_mousebuttondown(SDL_Event *e){
-  
-  for (int i=0; i<pieces_x; i++){
-    for(int j=0; j<pieces_y; j++){
-      if (pointInRect(&mouseposition, &pieces[i][j].piece_area)){
-        piece_held_by_mouse = &pieces[i][j];
-        // push 'piece_held_by_mouse' to front (drawn last)
-        piece_render_order.remove(piece_held_by_mouse);
-        piece_render_order.push_back(piece_held_by_mouse);
-/*        printf("%d %d is in %d %d (x %d y %d  w %d h %d)   cor %d %d\n", 
-               mouseposition.x,
-               mouseposition.y,
-               i, j,
-               piece_held_by_mouse->piece_area.x,
-               piece_held_by_mouse->piece_area.y,
-               piece_held_by_mouse->piece_area.w,
-               piece_held_by_mouse->piece_area.h,
-               piece_held_by_mouse->correct_pos.x,
-               piece_held_by_mouse->correct_pos.y);
-*/
+/*
+ * Join all pieces that fit, e.g after a restore. The groups are raised
+ * once at the end, in the order of their topmost members.
+ */
+void join_all_groups(){
+  for (int x=0; x<pieces_x; x++){
+    for (int y=0; y<pieces_y; y++){
+      if (x+1 < pieces_x && pieces_fit(&pieces[x][y], &pieces[x+1][y])){
+        merge_groups(&pieces[x][y], &pieces[x+1][y]);
+      }
+      if (y+1 < pieces_y && pieces_fit(&pieces[x][y], &pieces[x][y+1])){
+        merge_groups(&pieces[x][y], &pieces[x][y+1]);
       }
     }
   }
+
+  std::vector<piece_group*> joined;
+  for (unsigned int i=0; i<groups.size(); i++){
+    if (groups[i].members.size() > 1){
+      joined.push_back(&groups[i]);
+    }
+  }
+  std::sort(joined.begin(), joined.end(), lower_top_z);
+  for (unsigned int i=0; i<joined.size(); i++){
+    raise_group(joined[i]);
+  }
 }
 
-void handle_mousemotion(SDL_Event *e){
-//  printf("%d  %d\n", e->motion.x, e->motion.y);
-  if(piece_held_by_mouse){
-    piece_held_by_mouse->current_pos.x += e->motion.x - mouseposition.x;
-    piece_held_by_mouse->current_pos.y += e->motion.y - mouseposition.y;
-    piece_held_by_mouse->piece_area.x  += e->motion.x - mouseposition.x;
-    piece_held_by_mouse->piece_area.y  += e->motion.y - mouseposition.y;
+/*
+ * Turn the group of p by 90 degrees clockwise around the center of p
+ */
+void turn_group(piece *p){
+  piece_group *g = group_of(p);
+  for (unsigned int i=0; i<g->members.size(); i++){
+    piece *m = g->members[i];
+    int dx = m->current_pos.x - p->current_pos.x; // all frames have the same size
+    int dy = m->current_pos.y - p->current_pos.y;
+    m->current_pos.x = p->current_pos.x - dy;
+    m->current_pos.y = p->current_pos.y + dx;
+    m->current_rotation = (m->current_rotation + 90) % 360;
+  }
+  group_texture_due(g);
+}
 
-/*    printf("%d %d  (x %d y %d  w %d h %d)   cor %d %d   dist %d rot %d\n", 
-           mouseposition.x,
-           mouseposition.y,
-           piece_held_by_mouse->piece_area.x,
-           piece_held_by_mouse->piece_area.y,
-           piece_held_by_mouse->piece_area.w,
-           piece_held_by_mouse->piece_area.h,
-           piece_held_by_mouse->correct_pos.x,
-           piece_held_by_mouse->correct_pos.y,
-           distance(&piece_held_by_mouse->current_pos, &piece_held_by_mouse->correct_pos),
-           piece_held_by_mouse->current_rotation);
-*/
-    if (distance(&piece_held_by_mouse->current_pos, &piece_held_by_mouse->correct_pos) < auto_correct_distance &&
-          piece_held_by_mouse->current_rotation == 0){
-      piece_held_by_mouse->current_pos = piece_held_by_mouse->correct_pos;
-
-      bool all_pieces_correct = true;
-      for (int i=0; i<pieces_x; i++){
-        for(int j=0; j<pieces_y; j++){
-          if (distance(&pieces[i][j].current_pos, &pieces[i][j].correct_pos) > 1 ||
-              pieces[i][j].current_rotation != 0){
-            all_pieces_correct = false;
-          }
-        }
+/*
+ * Snap the held group to a piece outside of it that one of its members
+ * would fit, if one is closer than auto_correct_distance. Only the members
+ * on the border of the group have such neighbours, each is checked against
+ * them where they lie, so the cost depends on the border of the group and
+ * not on its area or the number of pieces.
+ */
+void snap_to_neighbours(){
+  const int dirs[4][2] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
+  const int held_root = held_group - &groups[0];
+  int best = auto_correct_distance;
+  SDL_Point snap;
+
+  for (unsigned int i=0; i<held_group->border.size(); i++){
+    const piece *m = held_group->border[i];
+    for (int d=0; d<4; d++){
+      int x = m->piece_idx_x + dirs[d][0];
+      int y = m->piece_idx_y + dirs[d][1];
+      if (x < 0 || x >= pieces_x || y < 0 || y >= pieces_y ||
+          piece_groups.find(piece_label(x, y)) == held_root ||
+          !pieces[x][y].loaded ||
+          pieces[x][y].current_rotation != m->current_rotation){
+        continue;
       }
-      if (all_pieces_correct){
-        printf("Congratulations, puzzle is finished!\n");
+      const piece *c = &pieces[x][y];
+      SDL_Point fit = fit_offset(c, m);
+      SDL_Rect pos = m->current_pos; // where the member is dragged to and where it would fit
+      SDL_Rect target = m->current_pos;
+      pos.x += held_offset.x;
+      pos.y += held_offset.y;
+      target.x = c->current_pos.x + fit.x;
+      target.y = c->current_pos.y + fit.y;
+      int dist = distance(&pos, &target);
+      if (dist < best){
+        best = dist;
+        snap.x = target.x - m->current_pos.x;
+        snap.y = target.y - m->current_pos.y;
       }
     }
+  }
 
+  if (best < auto_correct_distance){
+    held_offset = snap;
   }
-  mouseposition.x = e->motion.x;
-  mouseposition.y = e->motion.y;
 }
 
-void handle_event(SDL_Event *e){
-  switch(e->type){
-  case SDL_QUIT: 
-    running = false; 
-    break;
+/*
+ * Saved games, see save_game.h
+ *
+ * With --save the game is restored from the file at startup and saved while
+ * it is played: every piece put down, turned or raised is queued for the
+ * journal, and once the journal holds as many records as there are pieces
+ * (at least 256) a new snapshot is queued instead. All writing happens on
+ * the thread of 'autosave'.
+ */
+std::vector<uint8_t> saved_game; // the snapshot read at startup, if it fits the photo
 
-  case SDL_KEYDOWN: {
-    handle_keypress(e);
-    break;
+/*
+ * Read the snapshot and take the puzzle parameters from it, so the same
+ * puzzle is made again. Called before init().
+ */
+void read_saved_parameters(){
+  puzzle_cache_key key;
+  if (!read_file(save_filename, saved_game)){
+    saved_game.clear();
+    return; // a new game
   }
- 
-  case SDL_KEYUP: {
-    handle_keyrelease(e);
-//    handle_keyrelease(e->key.keysym.sym,
-//                      e->key.keysym.mod/*,
-//                      e->key.keysym.unicode*/);
-    break;
+  const save_header *h = (const save_header*)&saved_game[0];
+  if (saved_game.size() < sizeof(*h) ||
+      memcmp(h->magic, save_magic, sizeof(h->magic)) != 0 ||
+      h->version != save_version ||
+      saved_game.size() != sizeof(*h) + (size_t)h->num_pieces*sizeof(save_piece) ||
+      h->num_pieces != (uint32_t)(h->key.pieces_x*h->key.pieces_y) ||
+      !hash_file(photo_filename, &key.image_hash, &key.image_size) ||
+      key.image_hash != h->key.image_hash ||
+      key.image_size != h->key.image_size){
+    printf("%s is not a saved game of this photo, starting a new game\n", save_filename);
+    saved_game.clear();
+    return;
   }
 
-  case SDL_MOUSEMOTION:{
-    handle_mousemotion(e);
-    break;
+  screen_width = h->key.screen_width;
+  screen_height = h->key.screen_height;
+  pieces_x = h->key.pieces_x;
+  pieces_y = h->key.pieces_y;
+  seed = h->key.seed;
+  seed_given = true;
+}
+
+/*
+ * Put a piece where the save has it, raising it if it was raised
+ */
+void apply_saved_piece(const save_piece &s){
+  piece *p = label_to_piece(s.label);
+  p->current_pos.x = s.x;
+  p->current_pos.y = s.y;
+  p->current_rotation = s.rotation % 360 / 90 * 90;
+  if (s.raised){
+    raise_piece(p);
   }
+}
 
-  case SDL_MOUSEBUTTONUP:{
-    switch(e->button.button){
-    case SDL_BUTTON_LEFT:   handle_left_mousebuttonup(e);  break;
-    case SDL_BUTTON_RIGHT:  handle_right_mousebuttonup(e); break;
-    default:                                               break;
-    }
-    break;
+/*
+ * Rebuild the board from the snapshot and the journal, returns the
+ * generation of the snapshot (0 if there is none)
+ */
+uint32_t restore_game(){
+  const int num_pieces = pieces_x*pieces_y;
+  if (saved_game.empty()){
+    return 0;
   }
+  const save_header *h = (const save_header*)&saved_game[0];
+  const save_piece *snapshot = (const save_piece*)&saved_game[sizeof(*h)];
 
-  case SDL_MOUSEBUTTONDOWN:{
-    switch(e->button.button){
-    case SDL_BUTTON_LEFT:   handle_left_mousebuttondown(e);  break;
-    case SDL_BUTTON_RIGHT:  handle_right_mousebuttondown(e); break;
-    default:                                                 break;
+  /* every piece exactly once, or the render order would miss some */
+  std::vector<bool> seen(num_pieces, false);
+  if (!same_puzzle_cache_key(h->key, puzzle_key) || (int)h->num_pieces != num_pieces){
+    return 0;
+  }
+  for (int i=0; i<num_pieces; i++){
+    if (snapshot[i].label >= (uint32_t)num_pieces || seen[snapshot[i].label]){
+      printf("The saved game in %s is damaged, starting a new game\n", save_filename);
+      return 0;
     }
-    break;
+    seen[snapshot[i].label] = true;
   }
 
-  default:
-    break;
-  }  
+  piece_render_order.clear();
+  for (int i=0; i<num_pieces; i++){
+    save_piece s = snapshot[i];
+    s.raised = 1; // the snapshot is in render order
+    apply_saved_piece(s);
+  }
 
-}
+  std::vector<uint8_t> journal;
+  int replayed = 0;
+  if (read_file(std::string(save_filename) + ".journal", journal) && journal.size() >= sizeof(journal_header)){
+    const journal_header *jh = (const journal_header*)&journal[0];
+    const save_piece *records = (const save_piece*)&journal[sizeof(*jh)];
+    int count = (journal.size() - sizeof(*jh))/sizeof(save_piece); // a torn last record is left out
+
+    if (memcmp(jh->magic, journal_magic, sizeof(jh->magic)) == 0 &&
+        jh->version == save_version &&
+        jh->generation == h->generation){
+      for (int i=0; i<count; i++){
+        if (records[i].label < (uint32_t)num_pieces){
+          apply_saved_piece(records[i]);
+          replayed++;
+        }
+      }
+    }
+  }
 
+  for (int i=0; i<pieces_x; i++){
+    for(int j=0; j<pieces_y; j++){
+      reindex_piece(&pieces[i][j]);
+      update_piece_correct(&pieces[i][j]);
+    }
+  }
+  join_all_groups();
+  printf("Restored the game from %s (%d changes since it was saved)\n", save_filename, replayed);
+  scene_dirty = true;
+  static_layer_dirty = true;
+  return h->generation;
+}
 
-void events(){
-  SDL_Event e;
+save_writer autosave;
+int journal_length = 0; // records since the last snapshot
 
-  while(running && SDL_PollEvent(&e)){
-    handle_event(&e);
+/*
+ * Queue a snapshot of the whole board, it replaces the journal
+ */
+void save_snapshot(){
+  const int num_pieces = pieces_x*pieces_y;
+  std::vector<uint8_t> data(sizeof(save_header) + num_pieces*sizeof(save_piece));
+  save_header *h = (save_header*)&data[0];
+  save_piece *out = (save_piece*)&data[sizeof(*h)];
+
+  memcpy(h->magic, save_magic, sizeof(h->magic));
+  h->version = save_version;
+  h->generation = 0; // set by the writer
+  h->key = puzzle_key;
+  h->num_pieces = num_pieces;
+  h->reserved = 0;
+
+  int n = 0;
+  for (unsigned int i=0; i<piece_render_order.size(); i++){
+    const piece *p = piece_render_order[i];
+    if (p->z != i){
+      continue; // stale
+    }
+    out[n].label = piece_label(p->piece_idx_x, p->piece_idx_y);
+    out[n].x = p->current_pos.x;
+    out[n].y = p->current_pos.y;
+    out[n].rotation = p->current_rotation;
+    out[n].raised = 0;
+    out[n].reserved = 0;
+    n++;
   }
-};
 
-void loop(){
+  autosave.snapshot(data);
+  journal_length = 0;
 }
 
+/*
+ * Call when a piece has been put down, turned or raised
+ */
+void journal_piece(const piece * const p, bool raised){
+  if (!autosave.running()){
+    return;
+  }
+  save_piece s;
+  s.label = piece_label(p->piece_idx_x, p->piece_idx_y);
+  s.x = p->current_pos.x;
+  s.y = p->current_pos.y;
+  s.rotation = p->current_rotation;
+  s.raised = raised;
+  s.reserved = 0;
+  autosave.append(s);
+
+  if (++journal_length >= std::max(256, pieces_x*pieces_y)){
+    save_snapshot();
+  }
+}
 
-void render(){
-  /* background color */
+/*
+ * Restore the saved game and start saving, the first snapshot folds in the
+ * journal replayed
+ */
+void start_autosave(){
+  uint32_t generation = restore_game();
+  saved_game.clear();
+  autosave.start(save_filename, generation);
+  save_snapshot();
+}
+
+/*
+ * The group of p has moved or turned: index its pieces at their new place,
+ * save them and join what fits now
+ */
+void settle_group(piece *p){
+  piece_group *g = group_of(p);
+  for (unsigned int i=0; i<g->members.size(); i++){
+    reindex_piece(g->members[i]);
+    update_piece_correct(g->members[i]);
+    journal_piece(g->members[i], false);
+  }
+  join_neighbours(p);
+}
+
+void handle_right_mousebuttondown(SDL_Event *e){
+  if (held_group){
+    turn_group(piece_held_by_mouse); // settled when it is put down
+    scene_dirty = true;
+    return;
+  }
+
+  piece *p = piece_at(&mouseposition);
+
+  if (p){
+    turn_group(p);
+    settle_group(p);
+    scene_dirty = true;
+    static_layer_dirty = true;
+  }
+}
+
+void handle_left_mousebuttonup(SDL_Event *e){
+  if (held_group){
+    for (unsigned int i=0; i<held_group->members.size(); i++){
+      held_group->members[i]->current_pos.x += held_offset.x;
+      held_group->members[i]->current_pos.y += held_offset.y;
+    }
+    held_group->area.x += held_offset.x; // the texture still fits
+    held_group->area.y += held_offset.y;
+    settle_group(piece_held_by_mouse);
+    static_layer_dirty = true; // the group rests now, it belongs to the layer
+  }
+  piece_held_by_mouse = 0;
+  held_group = 0;
+}
+
+void handle_left_mousebuttondown(SDL_Event *e){
+  piece *p = piece_at(&mouseposition);
+
+  if (p){
+    piece_held_by_mouse = p;
+    held_group = group_of(p);
+    held_offset.x = 0;
+    held_offset.y = 0;
+    // push the group to front (drawn last)
+    for (unsigned int i=0; i<held_group->members.size(); i++){
+      raise_piece(held_group->members[i]);
+      journal_piece(held_group->members[i], true);
+    }
+    scene_dirty = true;
+    static_layer_dirty = true;
+/*    printf("%d %d is in %d %d (x %d y %d  w %d h %d)   cor %d %d\n", 
+           mouseposition.x,
+           mouseposition.y,
+           p->piece_idx_x, p->piece_idx_y,
+           piece_held_by_mouse->indexed_area.x,
+           piece_held_by_mouse->indexed_area.y,
+           piece_held_by_mouse->indexed_area.w,
+           piece_held_by_mouse->indexed_area.h,
+           piece_held_by_mouse->correct_pos.x,
+           piece_held_by_mouse->correct_pos.y);
+*/
+  }
+}
+
+void handle_mousemotion(SDL_Event *e){
+//  printf("%d  %d\n", e->motion.x, e->motion.y);
+  if(held_group){
+    held_offset.x += e->motion.x - mouseposition.x;
+    held_offset.y += e->motion.y - mouseposition.y;
+
+/*    printf("%d %d  (x %d y %d  w %d h %d)   cor %d %d   dist %d rot %d\n", 
+           mouseposition.x,
+           mouseposition.y,
+           piece_held_by_mouse->indexed_area.x,
+           piece_held_by_mouse->indexed_area.y,
+           piece_held_by_mouse->indexed_area.w,
+           piece_held_by_mouse->indexed_area.h,
+           piece_held_by_mouse->correct_pos.x,
+           piece_held_by_mouse->correct_pos.y,
+           distance(&piece_held_by_mouse->current_pos, &piece_held_by_mouse->correct_pos),
+           piece_held_by_mouse->current_rotation);
+*/
+    /*
+     * where the held piece is now, it jumps into its correct place with its
+     * group, or else the group jumps to a piece it fits
+     */
+    SDL_Rect pos = piece_held_by_mouse->current_pos;
+    pos.x += held_offset.x;
+    pos.y += held_offset.y;
+    if (distance(&pos, &piece_held_by_mouse->correct_pos) < auto_correct_distance &&
+          piece_held_by_mouse->current_rotation == 0){
+      held_offset.x = piece_held_by_mouse->correct_pos.x - piece_held_by_mouse->current_pos.x;
+      held_offset.y = piece_held_by_mouse->correct_pos.y - piece_held_by_mouse->current_pos.y;
+    }else{
+      snap_to_neighbours();
+    }
+
+    scene_dirty = true;
+  }
+  mouseposition.x = e->motion.x;
+  mouseposition.y = e->motion.y;
+}
+
+uint64_t now_ns(){
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec*(uint64_t)1000000000 + now.tv_nsec;
+}
+
+/*
+ * Input traces, see event_trace.h
+ *
+ * With --record every event handled is written to the trace, with the
+ * time since the first frame and the pass of the main loop it came in.
+ * --replay plays a trace back through handle_event() as fast as it can,
+ * a pass at a time, ignoring the input. With --bench it does so without
+ * a window and prints how many events per second were handled. Both load
+ * the whole puzzle before the first event, so a replay starts from the
+ * very same board.
+ */
+trace_writer trace_out;
+uint64_t trace_start = 0; // the first frame
+uint32_t trace_batch = 0; // passes of the main loop
+
+trace_header replay_header;
+std::vector<trace_event> replay_events;
+unsigned int replayed = 0; // events of replay_events handled so far
+uint64_t replay_ns = 0;    // spent handling them
+
+/*
+ * Read the trace and take the puzzle parameters from it, so the same
+ * puzzle is made again. Called before init().
+ */
+bool read_replay_parameters(){
+  uint64_t image_hash, image_size;
+  if (!read_trace(replay_filename, &replay_header, replay_events)){
+    printf("Couldn't read the trace %s\n", replay_filename);
+    return false;
+  }
+  if (!hash_file(photo_filename, &image_hash, &image_size) ||
+      image_hash != replay_header.key.image_hash ||
+      image_size != replay_header.key.image_size){
+    printf("%s is not a trace of this photo\n", replay_filename);
+    return false;
+  }
+
+  screen_width = replay_header.key.screen_width;
+  screen_height = replay_header.key.screen_height;
+  pieces_x = replay_header.key.pieces_x;
+  pieces_y = replay_header.key.pieces_y;
+  boardsize_percent = replay_header.key.boardsize_percent;
+  seed = replay_header.key.seed;
+  seed_given = true;
+  return true;
+}
+
+/*
+ * Hash of where all pieces are, equal after a replay and the game it was
+ * recorded from
+ */
+uint64_t board_state_hash(){
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int i=0; i<pieces_x*pieces_y; i++){
+    const piece *p = label_to_piece(i);
+    const int32_t state[4] = {p->current_pos.x, p->current_pos.y, p->current_rotation, (int32_t)p->z};
+    const uint8_t *bytes = (const uint8_t*)state;
+    for (unsigned int k=0; k<sizeof(state); k++){
+      h = (h ^ bytes[k]) * 0x100000001b3ULL;
+    }
+  }
+  return h;
+}
+
+void print_replay_summary(){
+  uint64_t recorded_ns = replay_events.empty() ? 0 : replay_events.back().time_ns;
+  printf("replayed %u events in %.3f ms, %.0f events/s (recorded in %.3f s)\n",
+         replayed, replay_ns/1e6, replay_ns ? replayed*1e9/replay_ns : 0.0, recorded_ns/1e9);
+  printf("board state %016llx\n", (unsigned long long)board_state_hash());
+}
+
+void handle_event(SDL_Event *e);
+
+/*
+ * Handle the events of the next pass in the trace, stops the game after the last one
+ */
+void replay_batch(){
+  uint64_t start = now_ns();
+  if (replayed < replay_events.size()){
+    uint32_t batch = replay_events[replayed].batch;
+    while (running && replayed < replay_events.size() && replay_events[replayed].batch == batch){
+      SDL_Event e = trace_to_sdl(replay_events[replayed++]);
+      handle_event(&e);
+    }
+  }
+  replay_ns += now_ns() - start;
+  if (replayed == replay_events.size()){
+    running = false;
+  }
+}
+
+void handle_event(SDL_Event *e){
+  if (trace_out.f && e->type != loader_event){
+    trace_out.write(trace_from_sdl(*e, now_ns() - trace_start, trace_batch));
+  }
+  frame_events++;
+  switch(e->type){
+  case SDL_QUIT: 
+    running = false; 
+    break;
+
+  case SDL_WINDOWEVENT:
+    scene_dirty = true; // exposed, resized, restored.. just draw again
+    break;
+
+  case SDL_RENDER_TARGETS_RESET:
+  case SDL_RENDER_DEVICE_RESET:
+    scene_dirty = true; // the content of the static layer and the group textures is lost
+    static_layer_dirty = true;
+    for (unsigned int i=0; i<groups.size(); i++){
+      if (groups[i].texture){
+        group_texture_due(&groups[i]);
+      }
+    }
+    break;
+
+  case SDL_KEYDOWN: {
+    handle_keypress(e);
+    break;
+  }
+ 
+  case SDL_KEYUP: {
+    handle_keyrelease(e);
+//    handle_keyrelease(e->key.keysym.sym,
+//                      e->key.keysym.mod/*,
+//                      e->key.keysym.unicode*/);
+    break;
+  }
+
+  case SDL_MOUSEMOTION:{
+    handle_mousemotion(e);
+    break;
+  }
+
+  case SDL_MOUSEBUTTONUP:{
+    switch(e->button.button){
+    case SDL_BUTTON_LEFT:   handle_left_mousebuttonup(e);  break;
+    case SDL_BUTTON_RIGHT:  handle_right_mousebuttonup(e); break;
+    default:                                               break;
+    }
+    break;
+  }
+
+  case SDL_MOUSEBUTTONDOWN:{
+    switch(e->button.button){
+    case SDL_BUTTON_LEFT:   handle_left_mousebuttondown(e);  break;
+    case SDL_BUTTON_RIGHT:  handle_right_mousebuttondown(e); break;
+    default:                                                 break;
+    }
+    break;
+  }
+
+  default:
+    break;
+  }  
+
+}
+
+
+void events(){
+  SDL_Event e;
+
+  trace_batch++;
+  if (replay_filename){
+    /* the input is ignored, but for quitting and what the window needs */
+    while(running && SDL_PollEvent(&e)){
+      if (e.type == SDL_QUIT || (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE)){
+        running = false;
+      }else if (e.type == SDL_WINDOWEVENT || e.type == SDL_RENDER_TARGETS_RESET || e.type == SDL_RENDER_DEVICE_RESET){
+        handle_event(&e);
+      }
+    }
+    replay_batch();
+    return;
+  }
+
+  while(running && SDL_PollEvent(&e)){
+    handle_event(&e);
+  }
+};
+
+
+#if SDL_VERSION_ATLEAST(2,0,18)
+/*
+ * Pieces drawn from the same atlas texture are collected as quads and
+ * submitted with one SDL_RenderGeometry() call
+ */
+std::vector<SDL_Vertex> batch_vertices;
+std::vector<int> batch_indices;
+
+void add_piece_to_batch(const piece * const p, int dx, int dy){
+  SDL_Rect dest;
+  SDL_Point center;
+  piece_image_dest(p, &dest, &center);
+  dest.x += dx;
+  dest.y += dy;
+
+  const float pivot_x = dest.x + center.x;
+  const float pivot_y = dest.y + center.y;
+  const float angle = p->current_rotation * M_PI / 180;
+  const float cos_a = cos(angle);
+  const float sin_a = sin(angle);
+  const atlas_page &page = atlas_pages[p->atlas_page];
+  const int first = batch_vertices.size();
+
+  /* corners in the order upper left, upper right, lower right, lower left */
+  for (int k=0; k<4; k++){
+    int right = (k == 1 || k == 2);
+    int lower = (k >= 2);
+    float dx = dest.x + right*dest.w - pivot_x;
+    float dy = dest.y + lower*dest.h - pivot_y;
+
+    SDL_Vertex v;
+    v.position.x = pivot_x + dx*cos_a - dy*sin_a;  // clockwise, like SDL_RenderCopyEx()
+    v.position.y = pivot_y + dx*sin_a + dy*cos_a;
+    v.color.r = v.color.g = v.color.b = v.color.a = 0xff;
+    v.tex_coord.x = (p->atlas_rect.x + right*p->atlas_rect.w) / (float)page.w;
+    v.tex_coord.y = (p->atlas_rect.y + lower*p->atlas_rect.h) / (float)page.h;
+    batch_vertices.push_back(v);
+  }
+
+  batch_indices.push_back(first);
+  batch_indices.push_back(first + 1);
+  batch_indices.push_back(first + 2);
+  batch_indices.push_back(first);
+  batch_indices.push_back(first + 2);
+  batch_indices.push_back(first + 3);
+}
+
+void draw_piece_batch(SDL_Texture *texture){
+  if (!batch_vertices.empty()){
+    SDL_RenderGeometry(sdlRenderer, texture, 
+                       &batch_vertices[0], batch_vertices.size(), 
+                       &batch_indices[0], batch_indices.size());
+    draw_calls++;
+  }
+  batch_vertices.clear();
+  batch_indices.clear();
+}
+#endif
+
+/*
+ * Frame pacing
+ *
+ * Frames are only drawn when the scene is dirty. With vsync SDL_RenderPresent()
+ * waits for the display, otherwise frames are started at most every
+ * frame_interval ns. A frame is late when it is done more than one interval
+ * after it was due (the scene got dirty or its slot started, whatever was
+ * later), with vsync it may take one more interval waiting for the display.
+ * After a late frame the schedule starts over instead of catching up with a
+ * burst of frames.
+ */
+bool vsync = false;
+uint64_t frame_interval = 1000000000/60; // ns
+uint64_t next_frame = 0;  // earliest start of the next frame, paced mode only
+uint64_t dirty_since = 0; // when the scene got dirty
+int frames = 0;
+int late_frames = 0;
+
+void setup_frame_pacing(){
+  SDL_RendererInfo info;
+  SDL_DisplayMode mode;
+
+  vsync = fps_limit == 0 && 
+          SDL_GetRendererInfo(sdlRenderer, &info) == 0 && 
+          (info.flags & SDL_RENDERER_PRESENTVSYNC);
+
+  if (fps_limit > 0){
+    frame_interval = 1000000000/fps_limit;
+  }else if (SDL_GetWindowDisplayMode(sdlWindow, &mode) == 0 && mode.refresh_rate > 0){
+    frame_interval = 1000000000/mode.refresh_rate;
+  }
+}
+
+/*
+ * ms to wait before the next frame may be drawn, 0 if it may be drawn now
+ */
+int ms_until_next_frame(){
+  uint64_t now = now_ns();
+  if (vsync || now >= next_frame){
+    return 0;
+  }
+  return (next_frame - now + 999999)/1000000;
+}
+
+void frame_done(){
+  uint64_t now = now_ns();
+  uint64_t due = std::max(dirty_since, next_frame);
+  uint64_t allowed = vsync ? 2*frame_interval : frame_interval;
+
+  frames++;
+  if (now > due + allowed){
+    late_frames++;
+    next_frame = now;
+  }else if (vsync){
+    next_frame = now;
+  }else{
+    next_frame = due + frame_interval;
+  }
+}
+
+/*
+ * Profiler
+ *
+ * For every drawn frame the time spent handling events, in loop() and in
+ * render() since the previous frame is recorded, along with the number of
+ * events and draw calls. The last frames are kept in rolling_stats for the
+ * HUD (F3), every frame is written to the --profile-out csv file.
+ */
+bool open_profile_out(){
+  if ((profile_out = fopen(profile_out_filename, "w")) == NULL){
+    printf("Couldn't open %s for the profile\n", profile_out_filename);
+    return false;
+  }
+  fprintf(profile_out, "frame,events_ns,loop_ns,render_ns,frame_ns,events,draw_calls,texture_bytes\n");
+  return true;
+}
+
+void profile_frame_done(){
+  stage_ns[STAGE_FRAME] = stage_ns[STAGE_EVENTS] + stage_ns[STAGE_LOOP] + stage_ns[STAGE_RENDER];
+  for (int i=0; i<STAGES; i++){
+    stage_stats[i].add(stage_ns[i]);
+  }
+  event_stats.add(frame_events);
+  draw_call_stats.add(draw_calls);
+
+  if (profile_out){
+    fprintf(profile_out, "%d,%lu,%lu,%lu,%lu,%d,%d,%ld\n", 
+            profiled_frames,
+            (unsigned long)stage_ns[STAGE_EVENTS],
+            (unsigned long)stage_ns[STAGE_LOOP],
+            (unsigned long)stage_ns[STAGE_RENDER],
+            (unsigned long)stage_ns[STAGE_FRAME],
+            frame_events, draw_calls, texture_bytes);
+  }
+
+  profiled_frames++;
+  for (int i=0; i<STAGES; i++){
+    stage_ns[i] = 0;
+  }
+  frame_events = 0;
+  draw_calls = 0;
+}
+
+void print_profile_summary(){
+  printf("%-10s %10s %10s %10s   (last %u of %d frames)\n", 
+         "ms", "p50", "p95", "p99", stage_stats[STAGE_FRAME].count, profiled_frames);
+  for (int i=0; i<STAGES; i++){
+    printf("%-10s %10.3f %10.3f %10.3f\n", stage_names[i],
+           stage_stats[i].percentile(50)/1e6,
+           stage_stats[i].percentile(95)/1e6,
+           stage_stats[i].percentile(99)/1e6);
+  }
+}
+
+bool open_hud_font(){
+  if ((!TTF_WasInit() && TTF_Init() < 0) ||
+      (hud_font = TTF_OpenFont(hud_font_filename, 14)) == NULL){
+    printf("No HUD, couldn't open font %s: %s\n", hud_font_filename, SDL_GetError());
+    SDL_ClearError();
+    return false;
+  }
+  return true;
+}
+
+void update_hud_texture(){
+  char text[512];
+  int len = 0;
+  SDL_Color color = {255, 255, 255, 255};
+
+  len += snprintf(text+len, sizeof(text)-len, "%-7s %8s %8s %8s\n", "ms", "p50", "p95", "p99");
+  for (int i=0; i<STAGES; i++){
+    len += snprintf(text+len, sizeof(text)-len, "%-7s %8.2f %8.2f %8.2f\n", stage_names[i],
+                    stage_stats[i].percentile(50)/1e6,
+                    stage_stats[i].percentile(95)/1e6,
+                    stage_stats[i].percentile(99)/1e6);
+  }
+  len += snprintf(text+len, sizeof(text)-len, "%-7s %8lu %8lu %8lu\n", "events", 
+                  (unsigned long)event_stats.percentile(50),
+                  (unsigned long)event_stats.percentile(95),
+                  (unsigned long)event_stats.percentile(99));
+  len += snprintf(text+len, sizeof(text)-len, "%-7s %8lu %8lu %8lu\n", "draws", 
+                  (unsigned long)draw_call_stats.percentile(50),
+                  (unsigned long)draw_call_stats.percentile(95),
+                  (unsigned long)draw_call_stats.percentile(99));
+  snprintf(text+len, sizeof(text)-len, "textures %ld kB, %d of %d frames late", 
+           texture_bytes/1024, late_frames, frames);
+
+  SDL_Surface *s = TTF_RenderUTF8_Blended_Wrapped(hud_font, text, color, screen_width);
+  if (hud_texture){
+    SDL_DestroyTexture(hud_texture);
+    hud_texture = 0;
+  }
+  if (s){
+    hud_texture = SDL_CreateTextureFromSurface(sdlRenderer, s);
+    hud_rect.x = 10;
+    hud_rect.y = 10;
+    hud_rect.w = s->w;
+    hud_rect.h = s->h;
+    SDL_FreeSurface(s);
+  }
+}
+
+void draw_hud(){
+  if (!hud_flag){
+    if (hud_texture){
+      SDL_DestroyTexture(hud_texture); // outdated once shown again
+      hud_texture = 0;
+    }
+    return;
+  }
+  if (!hud_font && !open_hud_font()){
+    hud_flag = 0;
+    return;
+  }
+
+  uint64_t now = now_ns();
+  if (!hud_texture || now - hud_updated > 500000000){
+    update_hud_texture();
+    hud_updated = now;
+  }
+  if (hud_texture){
+    SDL_Rect background = {hud_rect.x-5, hud_rect.y-5, hud_rect.w+10, hud_rect.h+10};
+    SDL_SetRenderDrawBlendMode(sdlRenderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 160);
+    SDL_RenderFillRect(sdlRenderer, &background);
+    SDL_SetRenderDrawBlendMode(sdlRenderer, SDL_BLENDMODE_NONE);
+    SDL_RenderCopy(sdlRenderer, hud_texture, 0, &hud_rect);
+    draw_calls += 2;
+  }
+}
+
+/*
+ * Draw a single piece, moved by dx,dy
+ */
+void draw_piece(const piece * const p, int dx, int dy){
+#if SDL_VERSION_ATLEAST(2,0,18)
+  add_piece_to_batch(p, dx, dy);
+  draw_piece_batch(p->texture);
+#else
+  SDL_Rect dest;
+  SDL_Point center;
+  piece_image_dest(p, &dest, &center);
+  dest.x += dx;
+  dest.y += dy;
+  SDL_RenderCopyEx(sdlRenderer, 
+                   p->texture, 
+                   &p->atlas_rect, 
+                   &dest,
+                   p->current_rotation,
+                   &center,
+                   SDL_FLIP_NONE);
+  draw_calls++;
+#endif
+}
+
+/*
+ * Draw the pieces of a group moved by dx,dy, from its texture if it is up
+ * to date
+ */
+void draw_group(const piece_group * const g, int dx, int dy){
+  if (g->texture && !g->texture_dirty){
+    SDL_Rect dest = {g->area.x + dx, g->area.y + dy, g->area.w, g->area.h};
+    SDL_RenderCopy(sdlRenderer, g->texture, 0, &dest);
+    draw_calls++;
+    return;
+  }
+
+#if SDL_VERSION_ATLEAST(2,0,18)
+  SDL_Texture *batch_texture = 0;
+  for (unsigned int i=0; i<g->members.size(); i++){
+    const piece *p = g->members[i];
+    if (!p->loaded){
+      continue;
+    }
+    if (p->texture != batch_texture){
+      draw_piece_batch(batch_texture);
+      batch_texture = p->texture;
+    }
+    add_piece_to_batch(p, dx, dy);
+  }
+  draw_piece_batch(batch_texture);
+#else
+  for (unsigned int i=0; i<g->members.size(); i++){
+    if (g->members[i]->loaded){
+      draw_piece(g->members[i], dx, dy);
+    }
+  }
+#endif
+}
+
+/*
+ * Composite the groups listed in dirty_groups into their textures, before
+ * the scene is drawn. A group waits while some of its pieces are not
+ * loaded yet, without render targets there are no group textures at all.
+ */
+void update_group_textures(){
+  if (dirty_groups.empty() || !SDL_RenderTargetSupported(sdlRenderer)){
+    return;
+  }
+
+  std::vector<int> waiting;
+  for (unsigned int k=0; k<dirty_groups.size(); k++){
+    piece_group *g = &groups[dirty_groups[k]];
+    if (!g->texture_dirty || g->members.empty()){
+      continue; // stale, joined into another group since
+    }
+    bool loaded = true;
+    for (unsigned int i=0; i<g->members.size(); i++){
+      loaded = loaded && g->members[i]->loaded;
+    }
+    if (!loaded){
+      waiting.push_back(dirty_groups[k]);
+      continue;
+    }
+
+    SDL_Rect area = group_screen_area(g);
+    if (g->texture && (g->area.w != area.w || g->area.h != area.h)){
+      SDL_DestroyTexture(g->texture);
+      texture_bytes -= (long)g->area.w*g->area.h*4;
+      g->texture = 0;
+    }
+    g->area = area;
+    if (!g->texture){
+      g->texture = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, area.w, area.h);
+      if (!g->texture){
+        SDL_ClearError();
+        g->texture_dirty = false; // drawn piece by piece, see draw_group()
+        continue;
+      }
+      SDL_SetTextureBlendMode(g->texture, SDL_BLENDMODE_BLEND);
+      texture_bytes += (long)area.w*area.h*4;
+    }
+
+    SDL_SetRenderTarget(sdlRenderer, g->texture);
+    SDL_SetRenderDrawColor(sdlRenderer, 0, 0, 0, 0);
+    SDL_RenderClear(sdlRenderer);
+    draw_group(g, -area.x, -area.y); // piece by piece, the texture is still dirty
+    SDL_SetRenderTarget(sdlRenderer, 0);
+    g->texture_dirty = false;
+    static_layer_dirty = true;
+  }
+  dirty_groups.swap(waiting);
+}
+
+/*
+ * Draw the hint outline as strips of triangles along the polylines, one
+ * pixel wide, or with --smooth-hint with a border on both sides that fades
+ * out (anti-aliasing). The strips go out in batches of hint_batch_vertices
+ * at most, so the vertex buffer stays small. Without SDL_RenderGeometry()
+ * every polyline is drawn as plain lines.
+ */
+const unsigned int hint_batch_vertices = 16384;
+
+/* on screen */
+vec2 hint_position(int i){
+  return vec2(piece_hint_rect.x + hint_points[i].x/(float)hint_subpixels,
+              piece_hint_rect.y + hint_points[i].y/(float)hint_subpixels);
+}
+
+void draw_hint(){
+#if SDL_VERSION_ATLEAST(2,0,18)
+  /* the vertices across the strip, offset from the curve and alpha */
+  static const float sharp_offsets[] = {-0.5f, 0.5f};
+  static const Uint8 sharp_alphas[] = {0xff, 0xff};
+  static const float smooth_offsets[] = {-1.25f, -0.25f, 0.25f, 1.25f};
+  static const Uint8 smooth_alphas[] = {0, 0xff, 0xff, 0};
+  const int columns = smooth_hint_flag ? 4 : 2;
+  const float *offsets = smooth_hint_flag ? smooth_offsets : sharp_offsets;
+  const Uint8 *alphas = smooth_hint_flag ? smooth_alphas : sharp_alphas;
+
+  SDL_SetRenderDrawBlendMode(sdlRenderer, SDL_BLENDMODE_BLEND); // used for geometry without a texture
+  for (unsigned int l=0; l+1<hint_lines.size(); l++){
+    const int first = hint_lines[l];
+    const int last = hint_lines[l+1];
+    if (batch_vertices.size() + (last - first)*columns > hint_batch_vertices){
+      draw_piece_batch(0);
+    }
+
+    for (int i=first; i<last; i++){
+      /* normal of the curve, from the points before and after */
+      const vec2 p = hint_position(i);
+      vec2 d = hint_position(std::min(i+1, last-1)) - hint_position(std::max(i-1, first));
+      float length = sqrtf(d.x*d.x + d.y*d.y);
+      vec2 n = length > 0 ? vec2(-d.y/length, d.x/length) : vec2(0, 0);
+
+      const int row = batch_vertices.size();
+      for (int k=0; k<columns; k++){
+        SDL_Vertex v;
+        v.position.x = p.x + offsets[k]*n.x;
+        v.position.y = p.y + offsets[k]*n.y;
+        v.color = hintcolor;
+        v.color.a = alphas[k]*hintcolor.a/0xff;
+        v.tex_coord.x = v.tex_coord.y = 0;
+        batch_vertices.push_back(v);
+      }
+      if (i == first){
+        continue;
+      }
+      for (int k=0; k+1<columns; k++){
+        const int above = row - columns + k; // of the previous point
+        batch_indices.push_back(above);
+        batch_indices.push_back(above + 1);
+        batch_indices.push_back(row + k + 1);
+        batch_indices.push_back(above);
+        batch_indices.push_back(row + k + 1);
+        batch_indices.push_back(row + k);
+      }
+    }
+  }
+  draw_piece_batch(0);
+  SDL_SetRenderDrawBlendMode(sdlRenderer, SDL_BLENDMODE_NONE);
+#else
+  std::vector<SDL_Point> line;
+  SDL_SetRenderDrawColor(sdlRenderer, hintcolor.r, hintcolor.g, hintcolor.b, hintcolor.a);
+  for (unsigned int l=0; l+1<hint_lines.size(); l++){
+    line.clear();
+    for (int i=hint_lines[l]; i<hint_lines[l+1]; i++){
+      const vec2 p = hint_position(i);
+      SDL_Point point = {.x = (int)p.x, .y = (int)p.y};
+      line.push_back(point);
+    }
+    SDL_RenderDrawLines(sdlRenderer, &line[0], line.size());
+    draw_calls++;
+  }
+#endif
+}
+
+/*
+ * Draw background, board and all pieces but those of 'skip' in render
+ * order. A group with a texture is drawn at the place of its lowest piece.
+ */
+void draw_scene(const piece_group * const skip){
+  static unsigned int pass = 0;
+  pass++;
+
+  /* background color */
   SDL_SetRenderDrawColor(sdlRenderer, bgcolor.r, bgcolor.g, bgcolor.b, bgcolor.a);
   SDL_RenderClear(sdlRenderer);
 
-  /* puzzle area, incl. hint if enabled */
-  SDL_SetRenderDrawColor(sdlRenderer, puzzleareacolor.r, puzzleareacolor.g, puzzleareacolor.b, puzzleareacolor.a);
-  SDL_RenderCopy(sdlRenderer, piece_hint_map_txt, 0, &piece_hint_rect);
+  /* puzzle area, incl. hint if enabled */
+  SDL_SetRenderDrawColor(sdlRenderer, puzzleareacolor.r, puzzleareacolor.g, puzzleareacolor.b, puzzleareacolor.a);
+  SDL_RenderFillRect(sdlRenderer, &piece_hint_rect);
+  if (hint_taken){
+    draw_hint();
+  }
+
+  /* frame for puzzle area */
+  SDL_SetRenderDrawColor(sdlRenderer, 255, 255, 255, 255);
+  SDL_RenderDrawLines(sdlRenderer, puzzlearea, 5);
+  draw_calls += 3;
+
+  /* pieces */ 
+#if SDL_VERSION_ATLEAST(2,0,18)
+  SDL_Texture *batch_texture = 0;
+#endif
+  for (unsigned int i=0; i<piece_render_order.size(); i++){
+    piece *p = piece_render_order[i];
+    if (p->z != i || !p->loaded){
+      continue; // stale (the piece has been raised since) or not there yet
+    }
+    piece_group *g = group_of(p);
+    if (g == skip){
+      continue;
+    }
+    if (g->texture && !g->texture_dirty){
+      if (g->drawn != pass){
+#if SDL_VERSION_ATLEAST(2,0,18)
+        draw_piece_batch(batch_texture);
+        batch_texture = 0;
+#endif
+        draw_group(g, 0, 0);
+        g->drawn = pass;
+      }
+      continue;
+    }
+#if SDL_VERSION_ATLEAST(2,0,18)
+    if (p->texture != batch_texture){
+      draw_piece_batch(batch_texture);
+      batch_texture = p->texture;
+    }
+    add_piece_to_batch(p, 0, 0);
+#else
+    draw_piece(p, 0, 0);
+#endif
+  }
+#if SDL_VERSION_ATLEAST(2,0,18)
+  draw_piece_batch(batch_texture);
+#endif
+}
+
+/*
+ * The static layer caches everything but the group held by the mouse in a
+ * render target. While a group is dragged a frame is then just a copy of the
+ * layer plus that group, no matter how many pieces there are. Set
+ * static_layer_dirty whenever the layer would look different, i.e a group
+ * is picked up, put down or turned. Without render target support every
+ * frame draws the whole scene.
+ */
+SDL_Texture *static_layer = 0;
+
+void create_static_layer(){
+  int w, h;
+  if (!SDL_RenderTargetSupported(sdlRenderer) ||
+      SDL_GetRendererOutputSize(sdlRenderer, &w, &h) != 0){
+    return;
+  }
+  static_layer = SDL_CreateTexture(sdlRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, w, h);
+  if (static_layer){
+    texture_bytes += (long)w*h*4;
+  }else{
+    printf("No static layer, drawing everything every frame: %s\n", SDL_GetError());
+    SDL_ClearError();
+  }
+}
+
+void render(){
+  update_group_textures();
+
+  if (!static_layer){
+    draw_scene(held_group);
+  }else{
+    if (static_layer_dirty){
+      SDL_SetRenderTarget(sdlRenderer, static_layer);
+      draw_scene(held_group);
+      SDL_SetRenderTarget(sdlRenderer, 0);
+      static_layer_dirty = false;
+    }
+
+    SDL_RenderCopy(sdlRenderer, static_layer, 0, 0);
+    draw_calls++;
+  }
+  if (held_group){
+    draw_group(held_group, held_offset.x, held_offset.y); // always on top, it has been raised
+  }
+
+  draw_hud();
+  SDL_RenderPresent(sdlRenderer);
+}
+
+
+/*
+bool pointInRect(int x, int y, SDL_Rect *r){
+  return 
+}
+*/
+void get_random_position( int *x, int *y){
+  SDL_Rect screen = {.x = 0, .y = 0, .w = screen_width - piecewidth, .h = screen_height - pieceheight};
+  SDL_Point p;
+  do{
+    *x = rand() % screen.w;
+    *y = rand() % screen.h;
+    p.x = *x;
+    p.y = *y;
+  }while(!(pointInRect(&p, &screen)));
+}
+
+uint64_t diff(timespec start, timespec end)
+{
+  timespec temp;
+  if ((end.tv_nsec-start.tv_nsec)<0) {
+    temp.tv_sec = end.tv_sec-start.tv_sec-1;
+    temp.tv_nsec = 1000000000+end.tv_nsec-start.tv_nsec;
+  } else {
+    temp.tv_sec = end.tv_sec-start.tv_sec;
+    temp.tv_nsec = end.tv_nsec-start.tv_nsec;
+  }
+  return temp.tv_nsec+temp.tv_sec*(uint64_t)1000000000;
+}
+
+/*
+ * Rasterize an edge curve into the pixels it passes through, in order.
+ *
+ * The curve is subdivided until the pixels at both ends of an interval are
+ * direct neighbours, so the number of evaluations follows the length of the
+ * curve in pixels and the boundary has no gaps. Consecutive pixels differ by
+ * one step in x or y (only a curve passing exactly through a pixel corner
+ * gives a diagonal step), which is what the marking in init() expects.
+ */
+void rasterize_edge_interval(const bezier<5> &curve, 
+                             float t0, SDL_Point p0, 
+                             float t1, SDL_Point p1, 
+                             int depth,
+                             std::vector<SDL_Point> &pixels){
+  if (abs(p1.x - p0.x) + abs(p1.y - p0.y) <= 1 || depth == 0){
+    if (p1.x != pixels.back().x || p1.y != pixels.back().y){
+      pixels.push_back(p1);
+    }
+    return;
+  }
+  float tm = (t0 + t1)/2;
+  vec2 m = curve.point(tm);
+  SDL_Point pm = {.x = (int)m.x, .y = (int)m.y};
+
+  rasterize_edge_interval(curve, t0, p0, tm, pm, depth-1, pixels);
+  rasterize_edge_interval(curve, tm, pm, t1, p1, depth-1, pixels);
+}
+
+void rasterize_edge(const bezier<5> &curve, std::vector<SDL_Point> &pixels){
+  vec2 start = curve.point(0);
+  vec2 end   = curve.point(1);
+  SDL_Point p0 = {.x = (int)start.x, .y = (int)start.y};
+  SDL_Point p1 = {.x = (int)end.x,   .y = (int)end.y};
+
+  pixels.clear();
+  pixels.push_back(p0);
+  rasterize_edge_interval(curve, 0, p0, 1, p1, 24, pixels);
+}
+
+/*
+ * The boundary between two neighbouring pieces, between x,y-1 and x,y
+ * (horizontal) or x-1,y and x,y
+ */
+struct puzzle_edge {
+  bool horizontal;
+  int x, y;
+  vec2 points[6]; // control points of the curve
+  int row_begin;  // the board rows its marks can touch, [row_begin, row_end)
+  int row_end;
+  std::vector<SDL_Point> pixels;
+  int outline_segments; // of the polyline for the hint, see outline_edge()
+
+  puzzle_edge(bool horizontal, int x, int y) : horizontal(horizontal), x(x), y(y), row_begin(0), row_end(0), outline_segments(0) {}
+};
+
+std::vector<puzzle_edge> edges;
+
+/*
+ * Pick the curve of an edge, with a random peg or hole. Every edge draws
+ * from a random stream of its own, so the puzzle only depends on the seed.
+ */
+void shape_edge(puzzle_edge &e, unsigned int index){
+  random_stream rng(seed, index);
+  vec2 *points = e.points;
+
+  if (e.horizontal){
+    //horizontal split
+    int flip = 1;
+    int flipback = -1;
+
+    if (rng.next()%2==0){
+      flip = -1;
+      flipback = 1;
+    }
+
+    points[0].x = 0;                 points[0].y = 0;
+    points[1].x = piecewidth;        points[1].y = (flipback*(pieceheight/4));
+    points[2].x = -(piecewidth);     points[2].y = (flip*(pieceheight/2));
+    points[3].x = (piecewidth)*2;    points[3].y = (flip*(pieceheight/2));
+    points[4].x = -(piecewidth/2);   points[4].y = (flipback*(pieceheight/4));
+    points[5].x = (piecewidth);      points[5].y = 0;
+
+    for(int i=0; i<6; i++){
+      points[i].x += e.x*(piecewidth);
+      points[i].y += e.y*(pieceheight);
+    }
+
+    for(int i=1; i<5; i++){
+      if (points[i].x != 0){
+        points[i].x += (rng.next() % std::max(1, piecewidth/20) ) - piecewidth/10;
+      }
+      if (points[i].y != 0){
+        points[i].y += (rng.next() % std::max(1, pieceheight/20) ) - pieceheight/10;
+      }
+    }
+  }else{
+    // vertical
+    int flip = 1;
+    int flipback = -1;
+
+    if (rng.next()%2==0){
+      flip = -1;
+      flipback = 1;
+    }
+
+    points[0].x = 0;                         points[0].y = 0;
+    points[1].x = (flipback*(piecewidth/8)); points[1].y = pieceheight + (pieceheight/4);
+    points[2].x = (flip*(piecewidth/2));     points[2].y = -pieceheight;
+    points[3].x = (flip*(piecewidth/2));     points[3].y = pieceheight*2;
+    points[4].x = (flipback*(piecewidth/8)); points[4].y = 0;
+    points[5].x = 0;                         points[5].y = pieceheight;
+  
+    for(int i=0; i<6; i++){
+      points[i].x += e.x*(piecewidth);
+      points[i].y += e.y*(pieceheight);
+    }
+
+    for(int i=1; i<5; i++){
+      if (points[i].x != 0){
+        points[i].x += (rng.next() % std::max(1, piecewidth/20) ) - piecewidth/10;
+      }
+      if (points[i].y != 0){
+        points[i].y += (rng.next() % std::max(1, pieceheight/20) ) - pieceheight/10;
+      }
+    }
+  }
+
+}
+
+/*
+ * The pixels of the curve, see rasterize_edge(), and the rows they touch
+ */
+void find_edge_pixels(puzzle_edge &e){
+  rasterize_edge(bezier<5>(e.points), e.pixels);
+
+  e.row_begin = height;
+  e.row_end = 0;
+  for (unsigned int i=0; i<e.pixels.size(); i++){
+    e.row_begin = std::min(e.row_begin, e.pixels[i].y - 1);
+    e.row_end   = std::max(e.row_end,   e.pixels[i].y + 2);
+  }
+}
 
-  /* frame for puzzle area */
-  SDL_SetRenderDrawColor(sdlRenderer, 255, 255, 255, 255);
-  SDL_RenderDrawLines(sdlRenderer, puzzlearea, 5);
+/*
+ * Mark the pixels on both sides of the edge in piece_map, only those in
+ * the board rows [row_begin, row_end)
+ */
+void mark_edge(const puzzle_edge &e, int row_begin, int row_end){
+  auto mark_piece_map = [&](int x, int y, uint32_t idx){
+    if (x >= 0 && x < width && y >= row_begin && y < row_end){
+      piece_map.set(x, y, idx);
+    }
+  };
+
+  if (e.horizontal){
+    uint32_t above_piece_idx = piece_label(e.x, e.y-1);
+    uint32_t piece_idx = piece_label(e.x, e.y);
+    
+    for(unsigned int i=0; i<e.pixels.size()-1; i++){
+      int pointx = e.pixels[i].x;
+      int pointy = e.pixels[i].y;
+
+      bool left         = e.pixels[i].x >= e.pixels[i+1].x;
+      bool strict_left  = e.pixels[i].x >  e.pixels[i+1].x;
+//      bool right        = e.pixels[i].x <= e.pixels[i+1].x;
+      bool strict_right = e.pixels[i].x <  e.pixels[i+1].x;
+      bool no_horiz_move= e.pixels[i].x == e.pixels[i+1].x;
+                
+      bool up           = e.pixels[i].y >= e.pixels[i+1].y;
+//      bool strict_up    = e.pixels[i].y >  e.pixels[i+1].y;
+      bool down         = e.pixels[i].y <= e.pixels[i+1].y;
+      bool strict_down  = e.pixels[i].y <  e.pixels[i+1].y;
+//      bool no_vert_move = e.pixels[i].y == e.pixels[i+1].y;
+
+
+      if (strict_right && up){
+        /* spline is moving to the right (possibly up-right) */
+        mark_piece_map(pointx, pointy -1, above_piece_idx);
+        mark_piece_map(pointx, pointy, piece_idx);
+        mark_piece_map(pointx, pointy +1, piece_idx);
+      }
+
+      if (up && left){
+        /* spline is moving up (possibly up left) */
+/*        mark_piece_map(pointx -1, pointy, above_piece_idx);
+*/        mark_piece_map(pointx, pointy, piece_idx);
+//        piece_map[ pointx +1] [ pointy ] = piece_idx +5;
+
+      }
+
+      if (down && strict_left){
+        /* spline is moving straight down or down left */
+        mark_piece_map(pointx -1, pointy, above_piece_idx);
+        mark_piece_map(pointx, pointy, piece_idx);
+//        mark_piece_map(pointx +1, pointy, piece_idx);
+      }
+
+      if (strict_down && strict_left){
+        /* spline is moving straight down or down left */
+        mark_piece_map(pointx, pointy, above_piece_idx);
+        mark_piece_map(pointx -1, pointy, piece_idx);
+//        mark_piece_map(pointx +1, pointy, piece_idx);
+      }
+
+      if (strict_down && strict_right){
+        /* spline is moving straight down or down left */
+
+        mark_piece_map(pointx, pointy -1, above_piece_idx);
+        mark_piece_map(pointx +1, pointy, above_piece_idx);
+        mark_piece_map(pointx, pointy, piece_idx);
+      }
+
+      if (strict_down && no_horiz_move){
+        mark_piece_map(pointx, pointy, piece_idx);
+        mark_piece_map(pointx +1, pointy, above_piece_idx);
+        
+      }
+    }
+  }else{
+    uint32_t piece_idx = piece_label(e.x, e.y);
+    uint32_t left_piece_idx = piece_label(e.x-1, e.y);
+      
+//    printf("x:y %d:%d  peice: %d   left: %d\n", x,y,piece_idx, left_piece_idx);
+
+    for(unsigned int i=0; i<e.pixels.size()-1; i++){
+      int pointx = e.pixels[i].x;
+      int pointy = e.pixels[i].y;
+
+      bool left         = e.pixels[i].x >= e.pixels[i+1].x;
+      bool strict_left  = e.pixels[i].x >  e.pixels[i+1].x;
+//      bool right        = e.pixels[i].x <= e.pixels[i+1].x;
+      bool strict_right = e.pixels[i].x <  e.pixels[i+1].x;
+      bool no_horiz_move= e.pixels[i].x == e.pixels[i+1].x;
+                
+      bool up           = e.pixels[i].y <= e.pixels[i+1].y;
+      bool strict_up    = e.pixels[i].y <  e.pixels[i+1].y;
+      bool down         = e.pixels[i].y >= e.pixels[i+1].y;
+      bool strict_down  = e.pixels[i].y >  e.pixels[i+1].y;
+//      bool no_vert_move = e.pixels[i].y == e.pixels[i+1].y;
+
+      if (strict_right && strict_up){
+        /* spline is moving to the right (possibly up-right) */
+        mark_piece_map(pointx-1, pointy, left_piece_idx);
+        mark_piece_map(pointx, pointy, piece_idx);
+        mark_piece_map(pointx, pointy +1, piece_idx);
+      }
+
+      if (up && left){
+        /* spline is moving up (possibly up left) */
+/*        mark_piece_map(pointx -1, pointy, above_piece_idx);
+*/        mark_piece_map(pointx, pointy, piece_idx);
+//        piece_map[ pointx +1] [ pointy ] = piece_idx +5;
+
+      }
+
+      if (up && strict_right){
+        /* spline is moving straight down or down left */
+        mark_piece_map(pointx, pointy, piece_idx);
+        mark_piece_map(pointx +1, pointy, piece_idx);
+      }
+
+
+      if (down && strict_left){
+        /* spline is moving straight down or down left */
+        mark_piece_map(pointx -1, pointy, left_piece_idx);
+        mark_piece_map(pointx, pointy, piece_idx);
+        mark_piece_map(pointx +1, pointy, piece_idx);
+      }
+
+      if (strict_down && strict_right){
+        /* spline is moving straight down or down left */
+
+//        mark_piece_map(pointx, pointy -1, left_piece_idx);
+        mark_piece_map(pointx +1, pointy, left_piece_idx);
+        mark_piece_map(pointx, pointy, piece_idx);
+        mark_piece_map(pointx -1, pointy, piece_idx);
+      }
+
+      if (strict_down && no_horiz_move){
+        mark_piece_map(pointx, pointy, piece_idx);
+        mark_piece_map(pointx -1, pointy, left_piece_idx);
+        
+      }
+    }
+  }
+}
+
+/*
+ * All edges between the pieces, in the order their random streams are numbered
+ */
+void list_edges(){
+  edges.clear();
+  for (int x=0; x<pieces_x; x++){
+    for (int y=0; y<pieces_y; y++){
+      if (y > 0){
+        edges.push_back(puzzle_edge(true, x, y));
+      }
+      if (x > 0){
+        edges.push_back(puzzle_edge(false, x, y));
+      }
+    }
+  }
+}
+
+/*
+ * How many segments the polyline of an edge gets in the hint, about one
+ * per hint_segment_length pixels along the curve
+ */
+const float hint_segment_length = 4;
+
+void outline_edge(puzzle_edge &e){
+  bezier<5> curve(e.points);
+  vec2 samples[17];
+  curve.points(samples, 16);
+  samples[16] = curve.point(1);
+
+  float length = 0;
+  for (int i=1; i<=16; i++){
+    vec2 d = samples[i] - samples[i-1];
+    length += sqrtf(d.x*d.x + d.y*d.y);
+  }
+  e.outline_segments = std::max(2, (int)ceilf(length/hint_segment_length));
+}
+
+/*
+ * Sample the curves of all edges into hint_points, in parallel, each edge
+ * into its own place found from the outline_segments
+ */
+void collect_hint_outline(){
+  hint_lines.resize(edges.size() + 1);
+  hint_lines[0] = 0;
+  for (unsigned int i=0; i<edges.size(); i++){
+    hint_lines[i+1] = hint_lines[i] + edges[i].outline_segments + 1;
+  }
+  hint_points.resize(hint_lines[edges.size()]);
+
+  parallel_for_bands(0, edges.size(), [](int begin, int end){
+    std::vector<vec2> samples;
+    for (int i=begin; i<end; i++){
+      bezier<5> curve(edges[i].points);
+      const int count = edges[i].outline_segments;
+      samples.resize(count + 1);
+      curve.points(&samples[0], count);
+      samples[count] = curve.point(1);
+
+      hint_point *out = &hint_points[hint_lines[i]];
+      for (int k=0; k<=count; k++){
+        out[k].x = lroundf(samples[k].x*hint_subpixels);
+        out[k].y = lroundf(samples[k].y*hint_subpixels);
+      }
+    }
+  });
+}
+
+/*
+ * The hint for a puzzle read from the cache, from the curves of the edges
+ * made again (the piece map is not touched)
+ */
+void make_hint_outline(){
+  list_edges();
+  parallel_for_bands(0, edges.size(), [](int begin, int end){
+    for (int i=begin; i<end; i++){
+      shape_edge(edges[i], i);
+      outline_edge(edges[i]);
+    }
+  });
+  collect_hint_outline();
+}
+
+/*
+ * Draw the boundaries between all pieces into piece_map.
+ *
+ * The edges are shaped and rasterized in parallel, each into its own pixel
+ * list. Then the marks are set in parallel bands of board rows, every band
+ * going through the edges in the same order, so where edges overlap the
+ * later one wins just like when drawing them one after another.
+ */
+void generate_edges(){
+  list_edges();
+
+  parallel_for_bands(0, edges.size(), [](int begin, int end){
+    for (int i=begin; i<end; i++){
+      shape_edge(edges[i], i);
+      find_edge_pixels(edges[i]);
+      if (show_hint_flag){
+        outline_edge(edges[i]);
+      }
+    }
+  });
+
+  parallel_for_bands(0, height, [](int row_begin, int row_end){
+    for (unsigned int i=0; i<edges.size(); i++){
+      if (edges[i].row_begin < row_end && edges[i].row_end > row_begin){
+        mark_edge(edges[i], row_begin, row_end);
+      }
+    }
+  });
+
+  for (unsigned int i=0; i<edges.size(); i++){
+    std::vector<SDL_Point>().swap(edges[i].pixels); // only the curves are kept
+  }
+}
+
+/*
+ * Run a function template for the label type used by piece_map
+ */
+#define FOR_LABEL_TYPE(function)                \
+  switch(piece_map.label_size){                 \
+  case 1:  function<uint8_t>();  break;         \
+  case 2:  function<uint16_t>(); break;         \
+  default: function<uint32_t>(); break;         \
+  }
+
+/*
+ * fill the frame with piece_ids, see region_fill.h
+ */
+template <typename T>
+void fill_piece_map(){
+  fill_unlabelled<T>(piece_map, 0);
+}
+
+/*
+ * Upper left corner of the frame of a piece (width*height, twice the piece size) in board coordinates
+ */
+int piece_frame_x(const piece * const p){
+  return p->piece_idx_x*piecewidth - piecewidth/2;
+}
+
+int piece_frame_y(const piece * const p){
+  return p->piece_idx_y*pieceheight - pieceheight/2;
+}
+
+/*
+ * Bounding box of the pixels of each piece, in board coordinates
+ */
+struct piece_bounds {
+  int x0, y0; // inclusive
+  int x1, y1; // exclusive
+};
+
+std::vector<piece_bounds> bounds_of_pieces;
+
+/*
+ * Find the bounding box of the labels of every piece in piece_map, for the
+ * same pixels as extract_pieces() copies. Every band of rows collects its
+ * own boxes which are merged afterwards.
+ */
+template <typename T>
+void find_piece_bounds(){
+  const int num_pieces = pieces_x*pieces_y;
+  const piece_bounds empty = {.x0 = width, .y0 = height, .x1 = 0, .y1 = 0};
+  std::mutex merge_lock;
+
+  bounds_of_pieces.assign(num_pieces, empty);
+
+  parallel_for_bands(2, height-2, [&](int row_begin, int row_end){
+    std::vector<piece_bounds> bounds(num_pieces, empty);
+    for (int j=row_begin; j<row_end; j++){
+      const T *labels = piece_map.row<T>(j);
+      for (int i=2; i<width-1; i++){
+        piece_bounds &b = bounds[labels[i]];
+        if (i <  b.x0) b.x0 = i;
+        if (i >= b.x1) b.x1 = i+1;
+        if (j <  b.y0) b.y0 = j;
+        if (j >= b.y1) b.y1 = j+1;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(merge_lock);
+    for (int k=0; k<num_pieces; k++){
+      piece_bounds &to = bounds_of_pieces[k];
+      to.x0 = std::min(to.x0, bounds[k].x0);
+      to.y0 = std::min(to.y0, bounds[k].y0);
+      to.x1 = std::max(to.x1, bounds[k].x1);
+      to.y1 = std::max(to.y1, bounds[k].y1);
+    }
+  });
+}
+
+/*
+ * Create the surface of every piece, sized to the bounding box of its pixels
+ * (within the piece frame, stray labels far away are ignored)
+ */
+void create_piece_surfaces(){
+  for (int x=0; x<pieces_x; x++){
+    for (int y=0; y<pieces_y; y++){
+      piece *p = &pieces[x][y];
+      const piece_bounds &b = bounds_of_pieces[piece_label(x, y)];
+
+      int x0 = std::max(b.x0 - piece_frame_x(p), 0);
+      int y0 = std::max(b.y0 - piece_frame_y(p), 0);
+      int x1 = std::min(b.x1 - piece_frame_x(p), p->width);
+      int y1 = std::min(b.y1 - piece_frame_y(p), p->height);
+
+      if (x1 <= x0 || y1 <= y0){
+        /* no pixels at all, keep a single transparent pixel in the middle */
+        x0 = p->width/2;
+        y0 = p->height/2;
+        x1 = x0 + 1;
+        y1 = y0 + 1;
+      }
+
+      p->image_rect.x = x0;
+      p->image_rect.y = y0;
+      p->image_rect.w = x1 - x0;
+      p->image_rect.h = y1 - y0;
+
+      /* the arena memory is zeroed, i.e the surroundings of the piece are transparent */
+      const int pitch = p->image_rect.w*photo->format->BytesPerPixel;
+      p->surface = SDL_CreateRGBSurfaceFrom(puzzle_arena.alloc((size_t)pitch*p->image_rect.h),
+                                            p->image_rect.w,
+                                            p->image_rect.h,
+                                            photo->format->BitsPerPixel,
+                                            pitch,
+                                            photo->format->Rmask,
+                                            photo->format->Gmask,
+                                            photo->format->Bmask,
+                                            photo->format->Amask);
+
+      p->hit_mask_pitch = (p->image_rect.w + 7)/8;
+      p->hit_mask = puzzle_arena.alloc_array<uint8_t>((size_t)p->hit_mask_pitch*p->image_rect.h);
+    }
+  }
+}
+
+/*
+ * Progressive start
+ *
+ * The window shows the board right away while the puzzle is cut (or read
+ * from the cache) on the loader thread. The loader hands over the hint
+ * and the atlas layout as soon as they are made, then every piece as soon
+ * as its image is extracted. The main thread takes them over in loop(),
+ * uploading as many pieces per frame as fit in upload_budget_ns, and a
+ * piece is drawn and can be picked up from then on.
+ */
+std::thread loader;
+std::mutex loader_lock;            // for everything handed over below
+std::vector<piece*> loaded_pieces; // in the order they were extracted
+int pieces_taken = 0;              // of loaded_pieces, by the main thread
+bool hint_loaded = false;          // hint_points and hint_lines are made
+bool atlas_loaded = false;         // atlas_pages and the atlas_rect of every piece are set
+bool load_failed = false;
+std::atomic<bool> load_cancelled(false); // unload_puzzle() while the loader still runs, checked between stages
+
+const uint64_t upload_budget_ns = 4000000; // per frame
+
+void wake_main_thread(){
+  if (loader_event != (Uint32)-1){
+    SDL_Event e;
+    memset(&e, 0, sizeof(e));
+    e.type = loader_event;
+    SDL_PushEvent(&e);
+  }
+}
+
+/*
+ * Set one of the flags above for the main thread
+ */
+void hand_over(bool *flag){
+  {
+    std::lock_guard<std::mutex> guard(loader_lock);
+    *flag = true;
+  }
+  wake_main_thread();
+}
+
+void hand_over_piece(piece *p){
+  bool caught_up; // the main thread waits for more, otherwise it comes back by itself
+  {
+    std::lock_guard<std::mutex> guard(loader_lock);
+    caught_up = pieces_taken == (int)loaded_pieces.size();
+    loaded_pieces.push_back(p);
+  }
+  if (caught_up){
+    wake_main_thread();
+  }
+}
+
+/*
+ * Fill the piece surface with photo data and its hit mask, from the pixels
+ * of its image_rect labelled with the piece
+ */
+template <typename T>
+void extract_piece(piece *p){
+  const int bpp = photo->format->BytesPerPixel;
+  const T label = piece_label(p->piece_idx_x, p->piece_idx_y);
+  const int surface_x = piece_frame_x(p) + p->image_rect.x; // in board coordinates
+  const int surface_y = piece_frame_y(p) + p->image_rect.y;
+
+  /* skip some pixels to make sure the puzzle area border is visible, like find_piece_bounds() */
+  const int x0 = std::max(surface_x, 2);
+  const int x1 = std::min(surface_x + p->image_rect.w, width-1);
+  const int y0 = std::max(surface_y, 2);
+  const int y1 = std::min(surface_y + p->image_rect.h, height-2);
+
+  for (int j=y0; j<y1; j++){
+    const T *labels = piece_map.row<T>(j);
+    const uint8_t *src_row = (uint8_t*)photo->pixels + j*photo->pitch;
+    uint8_t *dest_row = (uint8_t*)p->surface->pixels + (j - surface_y)*p->surface->pitch;
+    uint8_t *mask = &p->hit_mask[(j - surface_y)*p->hit_mask_pitch];
+
+    int i = x0;
+    while (i < x1){
+      if (labels[i] != label){
+        i++;
+        continue;
+      }
+      /* a run of pixels belonging to the piece */
+      int run_start = i;
+      while (i < x1 && labels[i] == label){
+        i++;
+      }
+
+      for (int k=run_start-surface_x; k<i-surface_x; k++){
+        mask[k/8] |= 1 << (k%8);
+      }
+      memcpy(dest_row + (run_start - surface_x)*bpp, src_row + run_start*bpp, (i - run_start)*bpp);
+    }
+  }
+}
+
+/*
+ * Extract the pieces on all workers, handing over each piece once it is done
+ */
+template <typename T>
+void extract_pieces(){
+  parallel_for_bands(0, pieces_x*pieces_y, [](int first, int last){
+    for (int i=first; i<last && !load_cancelled; i++){
+      piece *p = label_to_piece(i);
+      extract_piece<T>(p);
+      hand_over_piece(p);
+    }
+  });
+}
+
+/*
+ * Place the images of all pieces in as few atlas pages as the renderer
+ * allows, see init() for the page size
+ */
+int atlas_max_w = 4096;
+int atlas_max_h = 4096;
+const int atlas_padding = 1; // transparent, see upload_piece()
+
+void pack_pieces_in_atlas(){
+  std::vector<SDL_Rect> sizes;
+  std::vector<SDL_Rect> placement;
+  std::vector<int> page_of;
+
+  for (int y=0; y<pieces_y; y++){
+    for (int x=0; x<pieces_x; x++){
+      sizes.push_back(pieces[x][y].image_rect);
+    }
+  }
+
+  pack_atlas(sizes, atlas_max_w, atlas_max_h, atlas_padding, placement, page_of, atlas_pages);
+
+  for (int y=0; y<pieces_y; y++){
+    for (int x=0; x<pieces_x; x++){
+      pieces[x][y].atlas_rect = placement[piece_label(x, y)];
+      pieces[x][y].atlas_page = page_of[piece_label(x, y)];
+    }
+  }
+}
+
+/*
+ * Create the atlas pages, empty, the pieces are uploaded into them one by one
+ */
+void create_atlas_textures(){
+  const SDL_PixelFormat *format = pieces[0][0].surface->format; // there is no photo when read from the cache
+  Uint32 pixel_format = SDL_MasksToPixelFormatEnum(format->BitsPerPixel,
+                                                   format->Rmask,
+                                                   format->Gmask,
+                                                   format->Bmask,
+                                                   format->Amask);
+
+  for (unsigned int page=0; page<atlas_pages.size(); page++){
+    SDL_Texture *t = SDL_CreateTexture(sdlRenderer, pixel_format, SDL_TEXTUREACCESS_STATIC,
+                                       atlas_pages[page].w, atlas_pages[page].h);
+    SDL_SetTextureBlendMode(t, SDL_BLENDMODE_BLEND);
+    atlas_textures.push_back(t);
+    texture_bytes += (long)atlas_pages[page].w*atlas_pages[page].h*4;
+  }
+}
+
+/*
+ * Copy the piece into its place in the atlas page. The padding around it
+ * is uploaded along as transparent pixels, the rest of the page is never
+ * written so it can't be relied on.
+ */
+void upload_piece(piece *p){
+  const SDL_Surface *s = p->surface;
+  const int bpp = s->format->BytesPerPixel;
+  SDL_Rect r = {p->atlas_rect.x - atlas_padding, 
+                p->atlas_rect.y - atlas_padding,
+                p->atlas_rect.w + 2*atlas_padding, 
+                p->atlas_rect.h + 2*atlas_padding};
+  const int pitch = r.w*bpp;
+  std::vector<uint8_t> pixels((size_t)pitch*r.h, 0);
+
+  for (int y=0; y<s->h; y++){
+    memcpy(&pixels[(y + atlas_padding)*pitch + atlas_padding*bpp], 
+           (const uint8_t*)s->pixels + y*s->pitch, 
+           s->w*bpp);
+  }
+  p->texture = atlas_textures[p->atlas_page];
+  SDL_UpdateTexture(p->texture, &r, &pixels[0], pitch);
+}
+
+/*
+ * Stage timing for --bench, each call prints the time since the previous call
+ */
+timespec ts_stage;
+timespec ts_init_start;
+
+void stage_start(){
+  clock_gettime(CLOCK_MONOTONIC, &ts_stage);
+  ts_init_start = ts_stage;
+}
+
+void stage_done(const char * const name){
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (bench_flag){
+    printf("%-24s %10.3f ms\n", name, diff(ts_stage, now)/1e6);
+  }
+  ts_stage = now;
+}
+
+void print_bench_summary(){
+  timespec now;
+  struct rusage usage;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%-24s %10.3f ms\n", "total", diff(ts_init_start, now)/1e6);
+  long surface_bytes = 0;
+  for (int x=0; x<pieces_x; x++){
+    for (int y=0; y<pieces_y; y++){
+      surface_bytes += (long)pieces[x][y].surface->pitch * pieces[x][y].surface->h;
+    }
+  }
+
+  printf("%-24s %10ld kB\n", "peak memory", usage.ru_maxrss);
+  printf("%-24s %10ld kB\n", "piece surfaces", surface_bytes/1024);
+  printf("%-24s %10ld kB\n", "puzzle arena", (long)(puzzle_arena.capacity()/1024));
+  if (show_hint_flag){
+    printf("%-24s %10ld kB\n", "hint outline", 
+           (long)((hint_points.capacity()*sizeof(hint_point) + hint_lines.capacity()*sizeof(int))/1024));
+  }
+  for (unsigned int i=0; i<atlas_pages.size(); i++){
+    printf("atlas page %-13d %5dx%d\n", i, atlas_pages[i].w, atlas_pages[i].h);
+  }
+  printf("board %dx%d, %dx%d pieces of %dx%d\n", 
+         width, height, pieces_x, pieces_y, piecewidth, pieceheight);
+  printf("%-24s %10.1f %% (%d of %d)\n", "pieces placed",
+         puzzle_progress()*100, pieces_correct, pieces_x*pieces_y);
+}
+
+/*
+ * Cut the photo into pieces: decode it, draw the edges, fill piece_map and
+ * copy the pixels of every piece into its own surface. The hint, the
+ * atlas layout and the pieces are handed over as they are done.
+ */
+bool cut_puzzle(){
+  if ((photo = load_image_scaled(photo_filename, width, height, rmask,gmask,bmask,amask)) == 0){
+    fprintf(stderr, "Couldn't open image: %s\n", photo_filename);
+    return false;
+  }
+  stage_done("load photo");
+  if (load_cancelled){
+    return false;
+  }
+
+  generate_edges();
+  stage_done("generate edges");
+  if (load_cancelled){
+    return false;
+  }
+
+  if (show_hint_flag){
+    collect_hint_outline();
+    stage_done("hint outline");
+    hand_over(&hint_loaded);
+    if (load_cancelled){
+      return false;
+    }
+  }
+
+  /*
+   * fill the frame with piece_ids
+   */
+
+  FOR_LABEL_TYPE(fill_piece_map);
+
+  stage_done("fill piece_map");
+  if (load_cancelled){
+    return false;
+  }
+
+  /* debug: print the pixel to piece mapping (pipe it to a file) */
+/*
+  for(int j=0; j<height; j++){
+    for (int i=0; i<width; i++){
+      if ( piece_map.get(i,j) == piece_map.none)
+        printf(" ");
+      else
+        printf("%c", piece_map.get(i,j) + '0');
+    }
+    printf("\n");
+  }
+*/
+
+  FOR_LABEL_TYPE(find_piece_bounds);
+  if (load_cancelled){
+    return false;
+  }
+  create_piece_surfaces();
+  stage_done("create piece surfaces");
+  if (load_cancelled){
+    return false;
+  }
+
+  pack_pieces_in_atlas();
+  stage_done("pack atlas");
+  hand_over(&atlas_loaded);
+
+  /*
+   * Fill pieces with photo data
+   */
+  FOR_LABEL_TYPE(extract_pieces);
+
+  stage_done("extract pieces");
+  return !load_cancelled;
+}
+
+/*
+ * Puzzle cache
+ *
+ * With a given --seed the cut puzzle is stored in the cache directory, see
+ * puzzle_cache.h. The next launch with the same photo and parameters maps
+ * the file instead of cutting the puzzle again: the piece surfaces use the
+ * pixels in the mapping as they are, only the label map and the hit masks
+ * are copied.
+ */
+bool make_puzzle_cache_key(puzzle_cache_key *key){
+  memset(key, 0, sizeof(*key));
+  if (!hash_file(photo_filename, &key->image_hash, &key->image_size)){
+    return false;
+  }
+  key->screen_width = screen_width;
+  key->screen_height = screen_height;
+  key->pieces_x = pieces_x;
+  key->pieces_y = pieces_y;
+  key->boardsize_percent = boardsize_percent;
+  key->seed = seed;
+  stage_done("hash photo");
+  return true;
+}
+
+/*
+ * Is [offset, offset+size) within the mapped cache file?
+ */
+bool in_puzzle_cache(uint64_t offset, uint64_t size){
+  return offset <= puzzle_cache_file.size && size <= puzzle_cache_file.size - offset;
+}
+
+bool read_puzzle_cache(const puzzle_cache_key &key){
+  const int num_pieces = pieces_x*pieces_y;
+
+  if (!puzzle_cache_file.open(puzzle_cache_filename(puzzle_cache_dir, key).c_str())){
+    return false;
+  }
+  const uint8_t *data = puzzle_cache_file.data;
+  const puzzle_cache_header *h = (const puzzle_cache_header*)data;
+  const puzzle_cache_piece *entries = 0;
+
+  /* check everything before anything is taken over, a bad file is just a miss */
+  bool ok = in_puzzle_cache(0, sizeof(*h)) &&
+            memcmp(h->magic, puzzle_cache_magic, sizeof(h->magic)) == 0 &&
+            h->version == puzzle_cache_version &&
+            h->header_size == sizeof(*h) &&
+            h->file_size == puzzle_cache_file.size &&
+            same_puzzle_cache_key(h->key, key) &&
+            h->rmask == rmask && h->gmask == gmask && h->bmask == bmask && h->amask == amask &&
+            h->width == width && h->height == height &&
+            h->label_size == piece_map.label_size &&
+            in_puzzle_cache(h->pieces_offset, (uint64_t)num_pieces*sizeof(puzzle_cache_piece)) &&
+            in_puzzle_cache(h->labels_offset, (uint64_t)width*height*h->label_size);
+
+  if (ok){
+    entries = (const puzzle_cache_piece*)(data + h->pieces_offset);
+    for (int i=0; ok && i<num_pieces; i++){
+      const puzzle_cache_piece &e = entries[i];
+      ok = e.image_w > 0 && e.image_h > 0 &&
+           e.pitch >= e.image_w*4 &&
+           e.hit_mask_pitch == (e.image_w + 7)/8 &&
+           in_puzzle_cache(e.pixels_offset, (uint64_t)e.pitch*e.image_h) &&
+           in_puzzle_cache(e.hit_mask_offset, (uint64_t)e.hit_mask_pitch*e.image_h);
+    }
+  }
+  if (!ok){
+    printf("Ignoring puzzle cache file, it does not match\n");
+    puzzle_cache_file.close();
+    return false;
+  }
 
-  /* pieces */ 
-  for (std::list<piece*>::iterator it=piece_render_order.begin(); it!=piece_render_order.end(); ++it) {
-    SDL_RenderCopyEx(sdlRenderer, 
-                     (*it)->texture, 
-                     0, 
-                     &((*it)->current_pos),
-                     (*it)->current_rotation,
-                     0,
-                     SDL_FLIP_NONE);
+  memcpy(piece_map.labels, data + h->labels_offset, (size_t)width*height*h->label_size);
+
+  for (int x=0; x<pieces_x; x++){
+    for (int y=0; y<pieces_y; y++){
+      piece *p = &pieces[x][y];
+      const puzzle_cache_piece &e = entries[piece_label(x, y)];
+      const uint8_t *mask = data + e.hit_mask_offset;
+
+      p->image_rect.x = e.image_x;
+      p->image_rect.y = e.image_y;
+      p->image_rect.w = e.image_w;
+      p->image_rect.h = e.image_h;
+      p->hit_mask_pitch = e.hit_mask_pitch;
+      p->hit_mask = puzzle_arena.alloc_array<uint8_t>((size_t)e.hit_mask_pitch*e.image_h);
+      memcpy(p->hit_mask, mask, (size_t)e.hit_mask_pitch*e.image_h);
+      p->surface = SDL_CreateRGBSurfaceFrom(puzzle_cache_file.data + e.pixels_offset,
+                                            e.image_w, e.image_h, 32, e.pitch,
+                                            rmask, gmask, bmask, amask);
+    }
   }
-  
-  SDL_RenderPresent(sdlRenderer);
+  return true;
 }
+
 /*
-bool pointInRect(int x, int y, SDL_Rect *r){
-  return 
-}
-*/
-void get_random_position( int *x, int *y){
-  SDL_Rect screen = {.x = 0, .y = 0, .w = screen_width - piecewidth, .h = screen_height - pieceheight};
-  SDL_Point p;
-  do{
-    *x = rand() % screen.w;
-    *y = rand() % screen.h;
-    p.x = *x;
-    p.y = *y;
-  }while(!(pointInRect(&p, &screen)));
-}
+ * Store the cut puzzle, written to a temporary file first so a cache file
+ * is either complete or not there at all
+ */
+void write_puzzle_cache(const puzzle_cache_key &key){
+  const int num_pieces = pieces_x*pieces_y;
+  std::string filename = puzzle_cache_filename(puzzle_cache_dir, key);
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%d.tmp", (int)getpid());
+  std::string tmp_filename = filename + suffix;
+
+  if (photo->format->BytesPerPixel != 4 || !make_dirs(puzzle_cache_dir)){
+    return;
+  }
 
-bool init(){
-  width = screen_width*boardsize_percent; 
-  height= screen_height*boardsize_percent;
+  puzzle_cache_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, puzzle_cache_magic, sizeof(h.magic));
+  h.version = puzzle_cache_version;
+  h.header_size = sizeof(h);
+  h.key = key;
+  h.rmask = rmask;
+  h.gmask = gmask;
+  h.bmask = bmask;
+  h.amask = amask;
+  h.width = width;
+  h.height = height;
+  h.label_size = piece_map.label_size;
+
+  /* the layout, every section aligned */
+  std::vector<puzzle_cache_piece> entries(num_pieces);
+  uint64_t offset = puzzle_cache_aligned(sizeof(h));
+  h.pieces_offset = offset;
+  offset = puzzle_cache_aligned(offset + num_pieces*sizeof(puzzle_cache_piece));
+  h.labels_offset = offset;
+  offset = puzzle_cache_aligned(offset + (uint64_t)width*height*piece_map.label_size);
+
+  for (int i=0; i<num_pieces; i++){
+    const piece *p = label_to_piece(i);
+    puzzle_cache_piece &e = entries[i];
+    e.image_x = p->image_rect.x;
+    e.image_y = p->image_rect.y;
+    e.image_w = p->image_rect.w;
+    e.image_h = p->image_rect.h;
+    e.pitch = p->surface->pitch;
+    e.hit_mask_pitch = p->hit_mask_pitch;
+    e.pixels_offset = offset;
+    offset = puzzle_cache_aligned(offset + (uint64_t)e.pitch*e.image_h);
+    e.hit_mask_offset = offset;
+    offset = puzzle_cache_aligned(offset + (uint64_t)e.hit_mask_pitch*e.image_h);
+  }
+  h.file_size = offset;
 
-  piecewidth = width/pieces_x; // width per piece
-  pieceheight = height/pieces_y;
-        
+  FILE *f = fopen(tmp_filename.c_str(), "wb");
+  if (!f){
+    printf("Couldn't write the puzzle cache %s\n", tmp_filename.c_str());
+    return;
+  }
+  bool ok = write_at(f, 0, &h, sizeof(h)) &&
+            write_at(f, h.pieces_offset, &entries[0], num_pieces*sizeof(puzzle_cache_piece)) &&
+            write_at(f, h.labels_offset, piece_map.labels, (size_t)width*height*piece_map.label_size);
+
+  /* in file order, so write_at() only ever pads */
+  for (int i=0; ok && i<num_pieces; i++){
+    const piece *p = label_to_piece(i);
+    ok = write_at(f, entries[i].pixels_offset, p->surface->pixels, (size_t)entries[i].pitch*entries[i].image_h) &&
+         write_at(f, entries[i].hit_mask_offset, p->hit_mask, (size_t)entries[i].hit_mask_pitch*entries[i].image_h);
+  }
+  ok = ok && write_at(f, h.file_size, 0, 0); // the padding at the end
+  ok = fclose(f) == 0 && ok;
 
-  if (SDL_Init(SDL_INIT_EVERYTHING) < 0){
-    return false;
+  if (!ok || rename(tmp_filename.c_str(), filename.c_str()) != 0){
+    printf("Couldn't write the puzzle cache %s\n", filename.c_str());
+    unlink(tmp_filename.c_str());
   }
+}
 
-  piece_map = new int*[width];
-  for (int i=0; i<width; i++){
-    piece_map[i] = new int[height];
-    for(int j=0; j<height; j++){
-      piece_map[i][j] = -1;
+/*
+ * Everything the puzzle is made from, on the loader thread (or right in
+ * init() for --bench)
+ */
+void load_puzzle(bool use_cache){
+  piece_map.create(width, height, pieces_x*pieces_y);
+  stage_done("allocate piece_map");
+
+  if (use_cache && read_puzzle_cache(puzzle_key)){
+    stage_done("read puzzle cache");
+    if (load_cancelled){
+      return;
+    }
+    if (show_hint_flag){
+      make_hint_outline();
+      stage_done("hint outline");
+      hand_over(&hint_loaded);
     }
+    pack_pieces_in_atlas();
+    stage_done("pack atlas");
+    hand_over(&atlas_loaded);
+    for (int i=0; i<pieces_x*pieces_y; i++){
+      hand_over_piece(label_to_piece(i));
+    }
+    return;
   }
 
-  SDL_ShowCursor( SDL_ENABLE );
+  if (!cut_puzzle()){
+    if (!load_cancelled){
+      hand_over(&load_failed);
+    }
+    return;
+  }
+  if (use_cache){
+    write_puzzle_cache(puzzle_key);
+    stage_done("write puzzle cache");
+  }
+}
 
-  SDL_Surface *orig_photo;
+/*
+ * Take over what the loader has handed over so far, uploading pieces until
+ * 'budget_ns' is used up (at least one per call)
+ */
+void take_loaded_pieces(uint64_t budget_ns){
+  uint64_t start = now_ns();
+  bool hint, atlas, failed;
+  {
+    std::lock_guard<std::mutex> guard(loader_lock);
+    hint = hint_loaded;
+    atlas = atlas_loaded;
+    failed = load_failed;
+  }
 
-  if ((orig_photo = IMG_Load(photo_filename)) == 0){
-    fprintf(stderr, "Couldn't open image: %s\n", photo_filename);
-    return false;
+  if (failed){
+    /* the first puzzle has to load, after that a photo that can't be read is skipped */
+    if (!sdlWindow || !puzzle_changed || ++failed_loads >= photo_filenames.size()){
+      running = false;
+    }else{
+      printf("Skipping %s\n", photo_filename);
+      change_puzzle(1, 0);
+    }
+    return;
+  }
+  if (hint && !hint_taken){
+    hint_taken = true;
+    scene_dirty = true;
+    static_layer_dirty = true;
+  }
+  if (atlas && sdlRenderer && atlas_textures.empty()){
+    create_atlas_textures();
   }
 
-  photo = SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, rmask,gmask,bmask,amask);
+  for (;;){
+    piece *p = 0;
+    {
+      std::lock_guard<std::mutex> guard(loader_lock);
+      if (pieces_taken < (int)loaded_pieces.size()){
+        p = loaded_pieces[pieces_taken++];
+      }
+    }
+    if (!p){
+      return;
+    }
 
-  SDL_BlitScaled(orig_photo, 0, photo, 0);
+    if (sdlRenderer){
+      upload_piece(p);
+    }
+    p->loaded = true;
+    index_piece(p);
+    scene_dirty = true;
+    static_layer_dirty = true;
 
-  SDL_FreeSurface(orig_photo);
+    if (pieces_taken == pieces_x*pieces_y){
+      failed_loads = 0;
+    }
 
-  int flags = 0;// SDL_HWSURFACE | SDL_DOUBLEBUF;
-  if (fullscreen_flag){
-    flags |= SDL_WINDOW_FULLSCREEN;
+    if (now_ns() - start >= budget_ns){
+      return; // the rest in the next frames, the scene is dirty so they come soon
+    }
   }
+}
 
-  if((sdlWindow = SDL_CreateWindow("Photo Puzzle", 
-                                   SDL_WINDOWPOS_UNDEFINED, 
-                                   SDL_WINDOWPOS_UNDEFINED, 
-                                   screen_width, 
-                                   screen_height, 
-                                   flags)) == NULL) {
-    return false;
+void loop(){
+  if (pieces_taken < pieces_x*pieces_y){
+    take_loaded_pieces(upload_budget_ns);
   }
+}
 
-  if ((sdlRenderer = SDL_CreateRenderer(sdlWindow, -1, 0)) == NULL){
-    printf("SDL Error: %s\n", SDL_GetError());
-    return false;
-  }
-  SDL_ClearError();
+/*
+ * Make the puzzle of photo_filename: the pieces at random places, then the
+ * puzzle itself (see load_puzzle()). Everything it makes is taken down by
+ * unload_puzzle().
+ */
+bool start_puzzle(){
+  width = screen_width*boardsize_percent; 
+  height= screen_height*boardsize_percent;
 
-  srand(time(NULL));
+  piecewidth = width/pieces_x; // width per piece
+  pieceheight = height/pieces_y;
+
+  srand(seed);
+
+  pieces = puzzle_arena.alloc_array<piece*>(pieces_x);
+  piece *all_pieces = puzzle_arena.alloc_array<piece>((size_t)pieces_x*pieces_y);
 
-  pieces = new piece*[pieces_x];
-  
   for (int x=0; x<pieces_x; x++){
-    pieces[x] = new piece[pieces_y];
+    pieces[x] = all_pieces + (size_t)x*pieces_y;
     for (int y=0; y<pieces_y; y++){
 
       /* initialize basics for the piece */
@@ -419,389 +2974,235 @@ bool init(){
       pieces[x][y].current_pos.w = pieces[x][y].width;
       pieces[x][y].current_pos.h = pieces[x][y].height;
 
-      pieces[x][y].piece_area.x = pieces[x][y].current_pos.x + 0.5*piecewidth;
-      pieces[x][y].piece_area.y = pieces[x][y].current_pos.y + 0.5*pieceheight;
-      pieces[x][y].piece_area.w = piecewidth;
-      pieces[x][y].piece_area.h = pieceheight;
-
       pieces[x][y].current_rotation = (rand()%4)*90;
+      pieces[x][y].is_correct = false; // counted by update_piece_correct() once the pieces are indexed
 
       pieces[x][y].piece_idx_x = x;
       pieces[x][y].piece_idx_y = y;
-      pieces[x][y].surface = SDL_CreateRGBSurface(SDL_SWSURFACE, 
-                                                  pieces[x][y].width,
-                                                  pieces[x][y].height,
-                                                  photo->format->BitsPerPixel,
-                                                  photo->format->Rmask,
-                                                  photo->format->Gmask,
-                                                  photo->format->Bmask,
-                                                  photo->format->Amask);
 
       /*
-       * The surface for the piece is a bit bigger (twice the size..) than the piece so the peg will fit
+       * The frame for the piece is a bit bigger (twice the size..) than the piece so the peg will fit,
+       * the surface only covers the part of it the piece really uses (see create_piece_surfaces())
        */
-
-      // make the surroundings of the piece transparent
-      SDL_FillRect(pieces[x][y].surface, 0, SDL_MapRGBA(pieces[x][y].surface->format, 0,0,0,0));
-
+      pieces[x][y].surface = 0;
       pieces[x][y].texture = 0;
-
-      /* create the hole and peg where the pieces connect */
-      //horizontal split
-      if (y > 0){
-        int flip = 1;
-        int flipback = -1;
-
-        if (rand()%2==0){
-          flip = -1;
-          flipback = 1;
-        }
-
-        vec2 * points = new vec2[6];
-        points[0].x = 0;                 points[0].y = 0;
-        points[1].x = piecewidth;        points[1].y = (flipback*(pieceheight/4));
-        points[2].x = -(piecewidth);     points[2].y = (flip*(pieceheight/2));
-        points[3].x = (piecewidth)*2;    points[3].y = (flip*(pieceheight/2));
-        points[4].x = -(piecewidth/2);   points[4].y = (flipback*(pieceheight/4));
-        points[5].x = (piecewidth);      points[5].y = 0;
-
-        std::vector<vec2> vectors;
-
-        for(int i=0; i<6; i++){
-          points[i].x += x*(piecewidth);
-          points[i].y += y*(pieceheight);
-        }
-
-        for(int i=1; i<5; i++){
-          if (points[i].x != 0){
-            points[i].x += (rand() % (int)(piecewidth/20) ) - piecewidth/10;
-          }
-          if (points[i].y != 0){
-            points[i].y += (rand() % (int)(pieceheight/20) ) - pieceheight/10;
-          }
-        }
-
-        for (float f=0; f<=1; f += 0.0001){
-          vec2 p = getBezierPoint(points, 6, f);
-          vectors.push_back(p);
-        }
-        delete [] points; points = 0;
-
-        int above_piece_idx = (y-1)*pieces_x + x;
-        int piece_idx = (y)*pieces_x + x;
-        
-        for(unsigned int i=0; i<vectors.size()-1; i++){
-          int pointx = vectors[i].x;
-          int pointy = vectors[i].y;
-
-          bool left         = (int)vectors[i].x >= (int)vectors[i+1].x;
-          bool strict_left  = (int)vectors[i].x >  (int)vectors[i+1].x;
-//          bool right        = (int)vectors[i].x <= (int)vectors[i+1].x;
-          bool strict_right = (int)vectors[i].x <  (int)vectors[i+1].x;
-          bool no_horiz_move= (int)vectors[i].x == (int)vectors[i+1].x;
-                    
-          bool up           = (int)vectors[i].y >= (int)vectors[i+1].y;
-//          bool strict_up    = (int)vectors[i].y >  (int)vectors[i+1].y;
-          bool down         = (int)vectors[i].y <= (int)vectors[i+1].y;
-          bool strict_down  = (int)vectors[i].y <  (int)vectors[i+1].y;
-//          bool no_vert_move = (int)vectors[i].y == (int)vectors[i+1].y;
-
-
-          if (strict_right && up){
-            /* spline is moving to the right (possibly up-right) */
-            piece_map[ pointx] [ pointy -1 ] = above_piece_idx;
-            piece_map[ pointx] [ pointy    ] = piece_idx;
-            piece_map[ pointx] [ pointy +1 ] = piece_idx;
-          }
-
-          if (up && left){
-            /* spline is moving up (possibly up left) */
-/*            piece_map[ pointx -1] [ pointy ] = above_piece_idx ;
-*/            piece_map[ pointx   ] [ pointy ] = piece_idx ;
-//            piece_map[ pointx +1] [ pointy ] = piece_idx +5;
-
-          }
-
-          if (down && strict_left){
-            /* spline is moving straight down or down left */
-            piece_map[ pointx -1] [ pointy ] = above_piece_idx;
-            piece_map[ pointx   ] [ pointy ] = piece_idx;
-//            piece_map[ pointx +1] [ pointy ] = piece_idx;
-          }
-
-          if (strict_down && strict_left){
-            /* spline is moving straight down or down left */
-            piece_map[ pointx   ] [ pointy ] = above_piece_idx;
-            piece_map[ pointx -1] [ pointy ] = piece_idx;
-//            piece_map[ pointx +1] [ pointy ] = piece_idx;
-          }
-
-          if (strict_down && strict_right){
-            /* spline is moving straight down or down left */
-
-            piece_map[ pointx   ] [ pointy -1] = above_piece_idx;
-            piece_map[ pointx +1] [ pointy   ] = above_piece_idx;
-            piece_map[ pointx   ] [ pointy ] = piece_idx;
-          }
-
-          if (strict_down && no_horiz_move){
-            piece_map[ pointx   ] [ pointy ] = piece_idx;
-            piece_map[ pointx +1] [ pointy ] = above_piece_idx;
-            
-          }
-        }
-      }
-
-      // vertical
-      if (x>0){
-        int flip = 1;
-        int flipback = -1;
-
-        if (rand()%2==0){
-          flip = -1;
-          flipback = 1;
-        }
-
-        vec2 * points = new vec2[6];
-        points[0].x = 0;                         points[0].y = 0;
-        points[1].x = (flipback*(piecewidth/8)); points[1].y = pieceheight + (pieceheight/4);
-        points[2].x = (flip*(piecewidth/2));     points[2].y = -pieceheight;
-        points[3].x = (flip*(piecewidth/2));     points[3].y = pieceheight*2;
-        points[4].x = (flipback*(piecewidth/8)); points[4].y = 0;
-        points[5].x = 0;                         points[5].y = pieceheight;
-  
-        for(int i=0; i<6; i++){
-          points[i].x += x*(piecewidth);
-          points[i].y += y*(pieceheight);
-        }
-
-        for(int i=1; i<5; i++){
-          if (points[i].x != 0){
-            points[i].x += (rand() % (int)(piecewidth/20) ) - piecewidth/10;
-          }
-          if (points[i].y != 0){
-            points[i].y += (rand() % (int)(pieceheight/20) ) - pieceheight/10;
-          }
-        }
-
-        std::vector<vec2> vectors;
-        for (float f=0; f<=1; f += 0.0001){
-          vec2 p = getBezierPoint(points, 6, f);
-          vectors.push_back(p);
-        }
-        delete [] points; points = 0;
-
-        int piece_idx = (x+1) + (y)*pieces_x - 1;
-        int left_piece_idx = (x) + (y)*pieces_x - 1;
-          
-//        printf("x:y %d:%d  peice: %d   left: %d\n", x,y,piece_idx, left_piece_idx);
-
-        for(unsigned int i=0; i<vectors.size()-1; i++){
-          int pointx = vectors[i].x;
-          int pointy = vectors[i].y;
-
-          bool left         = (int)vectors[i].x >= (int)vectors[i+1].x;
-          bool strict_left  = (int)vectors[i].x >  (int)vectors[i+1].x;
-//          bool right        = (int)vectors[i].x <= (int)vectors[i+1].x;
-          bool strict_right = (int)vectors[i].x <  (int)vectors[i+1].x;
-          bool no_horiz_move= (int)vectors[i].x == (int)vectors[i+1].x;
-                    
-          bool up           = (int)vectors[i].y <= (int)vectors[i+1].y;
-          bool strict_up    = (int)vectors[i].y <  (int)vectors[i+1].y;
-          bool down         = (int)vectors[i].y >= (int)vectors[i+1].y;
-          bool strict_down  = (int)vectors[i].y >  (int)vectors[i+1].y;
-//          bool no_vert_move = (int)vectors[i].y == (int)vectors[i+1].y;
-
-          if (strict_right && strict_up){
-            /* spline is moving to the right (possibly up-right) */
-            piece_map[ pointx-1] [ pointy  ] = left_piece_idx;
-            piece_map[ pointx] [ pointy    ] = piece_idx;
-            piece_map[ pointx] [ pointy +1 ] = piece_idx;
-          }
-
-          if (up && left){
-            /* spline is moving up (possibly up left) */
-/*            piece_map[ pointx -1] [ pointy ] = above_piece_idx ;
-*/            piece_map[ pointx   ] [ pointy ] = piece_idx;
-//            piece_map[ pointx +1] [ pointy ] = piece_idx +5;
-
-          }
-
-          if (up && strict_right){
-            /* spline is moving straight down or down left */
-            piece_map[ pointx   ] [ pointy ] = piece_idx;
-            piece_map[ pointx +1] [ pointy ] = piece_idx;
-          }
-
-
-          if (down && strict_left){
-            /* spline is moving straight down or down left */
-            piece_map[ pointx -1] [ pointy ] = left_piece_idx;
-            piece_map[ pointx   ] [ pointy ] = piece_idx;
-            piece_map[ pointx +1] [ pointy ] = piece_idx;
-          }
-
-          if (strict_down && strict_right){
-            /* spline is moving straight down or down left */
-
-//            piece_map[ pointx   ] [ pointy -1] = left_piece_idx;
-            piece_map[ pointx +1] [ pointy   ] = left_piece_idx;
-            piece_map[ pointx   ] [ pointy ] = piece_idx;
-            piece_map[ pointx -1] [ pointy ] = piece_idx;
-          }
-
-          if (strict_down && no_horiz_move){
-            piece_map[ pointx   ] [ pointy ] = piece_idx;
-            piece_map[ pointx -1] [ pointy ] = left_piece_idx;
-            
-          }
-        }
-      }
+      pieces[x][y].loaded = false;
     }
   }
+  init_groups();
+  stage_done("create pieces");
 
+  bool use_cache = seed_given && !no_cache_flag && !puzzle_cache_dir.empty();
+  if ((use_cache || save_filename || record_filename) && !make_puzzle_cache_key(&puzzle_key)){
+    use_cache = false;
+  }
 
-  /*
-   * Create the hint map surface from the piece_map before it is completely filled (only the borders are in there now)
-   */  
   piece_hint_rect.x = screen_width /2 - width /2;
   piece_hint_rect.y = screen_height/2 - height/2;
   piece_hint_rect.w = width;
   piece_hint_rect.h = height;
 
-  piece_hint_map = SDL_CreateRGBSurface(SDL_SWSURFACE, 
-                                        width,
-                                        height,
-                                        32,0,0,0,0);
-  SDL_FillRect(piece_hint_map, 0, SDL_MapRGBA(piece_hint_map->format, 
-                                              puzzleareacolor.r,
-                                              puzzleareacolor.g,
-                                              puzzleareacolor.b,
-                                              puzzleareacolor.a));
-  if (show_hint_flag){
-    for(int j=0; j<height; j++){
-      for (int i=0; i<width; i++){
-        if (piece_map[i][j] != -1){
-          uint8_t *pixel = (uint8_t*)piece_hint_map->pixels + j*piece_hint_map->pitch + i*piece_hint_map->format->BytesPerPixel;
-          uint32_t *pixel32 = (uint32_t*)pixel;
-          *pixel32 = 0xffffffff;
-        }
-      }
+  piece_index.init(screen_width, screen_height, piecewidth, pieceheight);
+  for (int i=0; i<pieces_x; i++){
+    for(int j=0; j<pieces_y; j++){
+      raise_piece(&pieces[i][j]);
+      update_piece_correct(&pieces[i][j]); // indexed once loaded
     }
   }
-  piece_hint_map_txt = SDL_CreateTextureFromSurface(sdlRenderer, piece_hint_map);
 
   /*
-   * fill the frame with piece_ids
+   * Define square for puzzle area
    */
+  puzzlearea[0].x = screen_width /2 - width /2;  //upper left corner
+  puzzlearea[0].y = screen_height/2 - height/2;
+  puzzlearea[1].x = screen_width /2 + width /2;  // upper right corner
+  puzzlearea[1].y = screen_height/2 - height/2;
+  puzzlearea[2].x = screen_width /2 + width /2;  // lower right corner
+  puzzlearea[2].y = screen_height/2 + height/2;
+  puzzlearea[3].x = screen_width /2 - width /2;  // lower left corner
+  puzzlearea[3].y = screen_height/2 + height/2;
+  puzzlearea[4] = puzzlearea[0];                 // and back to the upper left corner
 
-  // top line
-  int cur_id = 0;
-  piece_map[0][0] = 0;
-  for (int i=0; i<width; i++){
-    if (piece_map[i][0] != -1)
-      cur_id = piece_map[i][0];
-    else
-      piece_map[i][0] = cur_id;
+  /* with a window the first frame is drawn while the puzzle is still being made, unless it is traced */
+  if (bench_flag || record_filename || replay_filename){
+    load_puzzle(use_cache);
+    take_loaded_pieces(UINT64_MAX);
+    return !load_failed;
   }
+  loader = std::thread(load_puzzle, use_cache);
+  return true;
+}
+
+bool init(){
+  stage_start();
 
-  // leftmost column
-  for (int i=0; i<height; i++){
-    if (piece_map[0][i] != -1)
-      cur_id = piece_map[0][i];
-    else
-      piece_map[0][i] = cur_id;
+  if (SDL_Init(bench_flag ? 0 : SDL_INIT_EVERYTHING) < 0){
+    return false;
   }
 
-  // fill the rest within the frame
-  for(int j=0; j<height; j++){
-    for (int i=0; i<width; i++){
-      if (piece_map[i][j] != -1)
-        cur_id = piece_map[i][j];
-      else
-        piece_map[i][j] = cur_id;
+  /* no window (and no textures) when only benchmarking the puzzle generation */
+  if (!bench_flag){
+    int flags = 0;// SDL_HWSURFACE | SDL_DOUBLEBUF;
+    if (fullscreen_flag){
+      flags |= SDL_WINDOW_FULLSCREEN;
     }
-  }
 
-  /* debug: print the pixel to piece mapping (pipe it to a file) */
-/*
-  for(int j=0; j<height; j++){
-    for (int i=0; i<width; i++){
-      if ( piece_map[i][j] == -1)
-        printf(" ");
-      else
-        printf("%c", piece_map[i][j] + '0');
+    if((sdlWindow = SDL_CreateWindow("Photo Puzzle", 
+                                     SDL_WINDOWPOS_UNDEFINED, 
+                                     SDL_WINDOWPOS_UNDEFINED, 
+                                     screen_width, 
+                                     screen_height, 
+                                     flags)) == NULL) {
+      return false;
     }
-    printf("\n");
-  }
-*/
 
-  /*
-   * Fill pieces with photo data
-   */
-  for (int i=2; i<width-1; i++){  //skip some pixels to make sure the puzzle area border is visible
-    for(int j=2; j<height-2; j++){
-      piece *p = xy_to_piece(i,j);
-      int pixpos_x = i - p->piece_idx_x*piecewidth  + 0.5*piecewidth;
-      int pixpos_y = j - p->piece_idx_y*pieceheight  + 0.5*pieceheight;
-
-      uint8_t *src  = (uint8_t*)     photo->pixels +    j    *     photo->pitch +     i   *     photo->format->BytesPerPixel;
-      uint8_t *dest = (uint8_t*)p->surface->pixels + pixpos_y*p->surface->pitch + pixpos_x*p->surface->format->BytesPerPixel;
-      switch(photo->format->BytesPerPixel){
-      case 4: *dest++ = *src++;  
-      case 3: *dest++ = *src++;  
-      case 2: *dest++ = *src++;  
-      case 1: *dest++ = *src++; 
-        break;
-      default:
-        exit(-1);
-      } 
+    if ((sdlRenderer = SDL_CreateRenderer(sdlWindow, -1, fps_limit ? 0 : SDL_RENDERER_PRESENTVSYNC)) == NULL){
+      printf("SDL Error: %s\n", SDL_GetError());
+      return false;
     }
+    SDL_ClearError();
+    setup_frame_pacing();
+    create_static_layer();
+
+    SDL_RendererInfo info;
+    if (SDL_GetRendererInfo(sdlRenderer, &info) == 0 &&
+        info.max_texture_width > 0 && info.max_texture_height > 0){
+      atlas_max_w = info.max_texture_width;
+      atlas_max_h = info.max_texture_height;
+    }
+    loader_event = SDL_RegisterEvents(1);
+
+    SDL_ShowCursor( SDL_ENABLE );
+    stage_done("create window");
   }
 
-  for (int i=0; i<pieces_x; i++){
-    for(int j=0; j<pieces_y; j++){
-      piece *p = &pieces[i][j];
-      p->texture = SDL_CreateTextureFromSurface(sdlRenderer, p->surface);
-      piece_render_order.push_back(p);
+  return start_puzzle();
+}
+
+/*
+ * Take down the puzzle being played, all of it, so another one can be
+ * started. The memory of puzzle_arena is kept for it.
+ */
+void unload_puzzle(){
+  load_cancelled = true;
+  if (loader.joinable()){
+    loader.join();
+  }
+  load_cancelled = false;
+  loaded_pieces.clear();
+  pieces_taken = 0;
+  hint_loaded = false;
+  atlas_loaded = false;
+  load_failed = false;
+
+  piece_held_by_mouse = 0;
+  held_group = 0;
+  for (unsigned int i=0; i<groups.size(); i++){
+    if (groups[i].texture){
+      SDL_DestroyTexture(groups[i].texture);
+      texture_bytes -= (long)groups[i].area.w*groups[i].area.h*4;
     }
   }
+  std::vector<piece_group>().swap(groups);
+  dirty_groups.clear();
+  piece_groups = union_find();
 
-  /*
-   * Define square for puzzle area
-   */
-  puzzlearea[0].x = screen_width /2 - width /2;  //upper left corner
-  puzzlearea[0].y = screen_height/2 - height/2;
-  puzzlearea[1].x = screen_width /2 + width /2;  // upper right corner
-  puzzlearea[1].y = screen_height/2 - height/2;
-  puzzlearea[2].x = screen_width /2 + width /2;  // lower right corner
-  puzzlearea[2].y = screen_height/2 + height/2;
-  puzzlearea[3].x = screen_width /2 - width /2;  // lower left corner
-  puzzlearea[3].y = screen_height/2 + height/2;
-  puzzlearea[4] = puzzlearea[0];                 // and back to the upper left corner
+  for (unsigned int i=0; i<atlas_textures.size(); i++){
+    SDL_DestroyTexture(atlas_textures[i]);
+    texture_bytes -= (long)atlas_pages[i].w*atlas_pages[i].h*4;
+  }
+  atlas_textures.clear();
+  atlas_pages.clear();
+  std::vector<hint_point>().swap(hint_points);
+  std::vector<int>().swap(hint_lines);
+  hint_taken = false;
 
-  return true;
+  for (int x=0; pieces && x<pieces_x; x++){
+    for (int y=0; y<pieces_y; y++){
+      SDL_FreeSurface(pieces[x][y].surface); // the pixels are in puzzle_arena or puzzle_cache_file
+    }
+  }
+  puzzle_cache_file.close(); // after the surfaces, they may point into it
+  SDL_FreeSurface(photo);
+  photo = 0;
+
+  piece_render_order.clear();
+  pieces_correct = 0;
+  piece_index.init(0, 0, 1, 1);
+  piece_map.destroy();
+  std::vector<puzzle_edge>().swap(edges);
+  std::vector<piece_bounds>().swap(bounds_of_pieces);
+
+  pieces = 0;
+  puzzle_arena.reset();
+
+  scene_dirty = true;
+  static_layer_dirty = true;
 }
 
 void quit(){
-  for (int i=0; i<pieces_x; i++){
-    for(int j=0; j<pieces_y; j++){
-      piece *p = &pieces[i][j];
-      SDL_FreeSurface(p->surface);
-      SDL_DestroyTexture(p->texture);
-    }
+  autosave.stop(); // writes what is still queued
+  unload_puzzle();
+  puzzle_arena.release();
+  if (static_layer){
+    SDL_DestroyTexture(static_layer);
+    static_layer = 0;
+  }
+  if (hud_texture){
+    SDL_DestroyTexture(hud_texture);
+    hud_texture = 0;
+  }
+  if (hud_font){
+    TTF_CloseFont(hud_font);
+    hud_font = 0;
+  }
+  if (TTF_WasInit()){
+    TTF_Quit();
   }
-  for (int i=0; i<width; i++){
-    delete [] piece_map[i];
+  if (profile_out){
+    fclose(profile_out);
+    profile_out = 0;
   }
-  delete [] piece_map;
 
   IMG_Quit();
   SDL_Quit();
 }
 
+/*
+ * Start over with another puzzle in the same process: the photo
+ * 'photo_step' further in photo_filenames, with 'more_pieces' more rows and
+ * columns (fewer if negative)
+ */
+void change_puzzle(int photo_step, int more_pieces){
+  if (save_filename || record_filename || replay_filename){
+    return; // the save or trace is of this puzzle
+  }
+  if (pieces_x + more_pieces < 2 || pieces_y + more_pieces < 2){
+    return;
+  }
+  if (more_pieces > 0 &&
+      (width/(pieces_x + more_pieces) < min_piece_size || height/(pieces_y + more_pieces) < min_piece_size)){
+    return;
+  }
+  unload_puzzle();
+  puzzle_changed = true;
+
+  photo_index = (photo_index + photo_step) % photo_filenames.size();
+  photo_filename = photo_filenames[photo_index];
+  pieces_x += more_pieces;
+  pieces_y += more_pieces;
+  if (!seed_given){
+    seed++; // another cut of the same photo
+  }
+
+  stage_start();
+  if (!start_puzzle()){
+    running = false;
+  }
+}
+
 void print_help(const char * const argv0){
-  printf("Usage %s: [OPTION]... <FILE>\n" 
+  printf("Usage %s: [OPTION]... <FILE>...\n" 
          "Make a basic puzzle game from a picture or photo of yours\n" 
          "\n" 
          "Mandatory arguments to long options are mandatory for short options too.\n" 
@@ -809,26 +3210,35 @@ void print_help(const char * const argv0){
          " -p, --pieces       number of pieces in puzzle, XxY or X*Y\n"
          " -a, --auto_correct_distance  max distance for pieces to auto correct the position\n"
          "     --hint         show hint for pieces\n"
+         "     --smooth-hint  show the hint anti-aliased\n"
          "     --fullscreen   show game in full screen (hit escape to quit)\n"
+         "     --bench        build the puzzle without a window, print the per-stage\n"
+         "                    time and overall peak memory and quit\n"
+         "     --fps          frames per second while pieces move, default is to\n"
+         "                    follow the display refresh (vsync)\n"
+         "     --profile-out  write the time of each stage and the draw calls of\n"
+         "                    every frame to a csv file\n"
+         "     --hud-font     TrueType font for the profiler overlay (F3)\n"
+         "     --seed         number to make the puzzle from, the same seed gives\n"
+         "                    the same puzzle. Puzzles with a seed are cached\n"
+         "     --cache-dir    directory for cached puzzles, default is\n"
+         "                    $XDG_CACHE_HOME/photopuzzle or ~/.cache/photopuzzle\n"
+         "     --no-cache     neither read nor write cached puzzles\n"
+         "     --save         continue the game saved in this file, if any, and\n"
+         "                    keep saving it there while playing\n"
+         "     --record       write the input to this trace file\n"
+         "     --replay       play the input of this trace file as fast as possible,\n"
+         "                    with --bench without a window, and print the events\n"
+         "                    handled per second\n"
+         "\n"
+         "While playing N goes on to the next FILE, + and - make a puzzle of the\n"
+         "same photo with more or fewer pieces. With --bench every FILE is made\n"
+         "in turn.\n"
         ,
          argv0);
 }
 
 
-unsigned int diff(timespec start, timespec end)
-{
-  timespec temp;
-  if ((end.tv_nsec-start.tv_nsec)<0) {
-    temp.tv_sec = end.tv_sec-start.tv_sec-1;
-    temp.tv_nsec = 1000000000+end.tv_nsec-start.tv_nsec;
-  } else {
-    temp.tv_sec = end.tv_sec-start.tv_sec;
-    temp.tv_nsec = end.tv_nsec-start.tv_nsec;
-  }
-  return temp.tv_nsec+temp.tv_sec*1000000000;
-}
-
-
 int main(int argc, char *argv[]){
   int c;
 
@@ -838,12 +3248,23 @@ int main(int argc, char *argv[]){
         {
           /* These options set a flag. */
           {"hint",                  no_argument,       &show_hint_flag, 1},
+          {"smooth-hint",           no_argument,       &smooth_hint_flag, 1},
           {"fullscreen",            no_argument,       &fullscreen_flag, 1},
+          {"bench",                 no_argument,       &bench_flag, 1},
+          {"no-cache",              no_argument,       &no_cache_flag, 1},
           /* These options don’t set a flag.
              We distinguish them by their indices. */
           {"size",                  required_argument,       0, 's'},
           {"pieces",                required_argument,       0, 'p'},
           {"auto_correct_distance",  required_argument,       0, 'a'},
+          {"fps",                   required_argument,       0, 'r'},
+          {"profile-out",           required_argument,       0, 'o'},
+          {"hud-font",              required_argument,       0, 'F'},
+          {"seed",                  required_argument,       0, 'S'},
+          {"cache-dir",             required_argument,       0, 'C'},
+          {"save",                  required_argument,       0, 'w'},
+          {"record",                required_argument,       0, 'R'},
+          {"replay",                required_argument,       0, 'P'},
           {0, 0, 0, 0}
         };
 
@@ -874,6 +3295,39 @@ int main(int argc, char *argv[]){
       auto_correct_distance = atoi(optarg);
       break;
 
+    case 'r':
+      fps_limit = std::max(0, atoi(optarg));
+      break;
+
+    case 'o':
+      profile_out_filename = strdup(optarg);
+      break;
+
+    case 'F':
+      hud_font_filename = strdup(optarg);
+      break;
+
+    case 'S':
+      seed = strtoul(optarg, 0, 0);
+      seed_given = true;
+      break;
+
+    case 'C':
+      puzzle_cache_dir = optarg;
+      break;
+
+    case 'w':
+      save_filename = strdup(optarg);
+      break;
+
+    case 'R':
+      record_filename = strdup(optarg);
+      break;
+
+    case 'P':
+      replay_filename = strdup(optarg);
+      break;
+
     case 'f':
       fullscreen_flag = 1;
       break;
@@ -922,51 +3376,130 @@ int main(int argc, char *argv[]){
     return -1;
   }
 
-  photo_filename = strdup(argv[optind++]);
+  while (optind < argc){
+    photo_filenames.push_back(strdup(argv[optind++]));
+  }
+  photo_filename = photo_filenames[0];
 
-  if (optind < argc) {
-    printf ("Ignored arguments: ");
-    while (optind < argc)
-      printf ("%s ", argv[optind++]);
-    printf("\n");
+  if (smooth_hint_flag){
+    show_hint_flag = 1;
+  }
+  if (save_filename && bench_flag){
+    save_filename = 0; // nothing to save
+  }
+  if (record_filename && replay_filename){
+    printf("--record is ignored with --replay\n");
+    record_filename = 0;
+  }
+  if (save_filename && (record_filename || replay_filename)){
+    printf("--save is ignored with --record and --replay, a trace starts from a new game\n");
+    save_filename = 0;
+  }
+  if (replay_filename && !read_replay_parameters()){
+    return 1;
+  }
+  if (save_filename){
+    read_saved_parameters();
+  }
+  if (!seed_given){
+    seed = time(NULL);
   }
 
   if (!init()){
     return 1;
   }
 
-  struct timespec ts_start;
-  struct timespec ts_events;
-  struct timespec ts_loop;
-  struct timespec ts_render;
-  int loopcount = 0;
+  if (save_filename){
+    start_autosave();
+  }
+
+  if (profile_out_filename && !bench_flag && !open_profile_out()){
+    quit();
+    return 1;
+  }
+
+  if (bench_flag){
+    print_bench_summary();
+    for (unsigned int i=1; i<photo_filenames.size() && !replay_filename; i++){
+      printf("\n");
+      change_puzzle(1, 0);
+      if (!running){
+        quit();
+        return 1;
+      }
+      print_bench_summary();
+    }
+    if (replay_filename){
+      while (running && replayed < replay_events.size()){
+        replay_batch();
+        loop();
+      }
+      print_replay_summary();
+    }
+    quit();
+    return 0;
+  }
+
+  if (record_filename && !trace_out.open(record_filename, puzzle_key)){
+    printf("Couldn't write the trace %s\n", record_filename);
+    quit();
+    return 1;
+  }
 
+  dirty_since = now_ns(); // the first frame
+  trace_start = dirty_since;
   while(running) {
-    clock_gettime(CLOCK_REALTIME, &ts_start);
+    /* 
+     * Sleep until something happens, or while a frame is pending until its
+     * slot starts. Events arriving meanwhile are handled right away, so a
+     * frame always shows the latest mouse position.
+     */
+    bool was_dirty = scene_dirty;
+    int timeout = scene_dirty ? ms_until_next_frame() : replay_filename ? 0 : 1000;
+    if (timeout > 0){
+      SDL_WaitEventTimeout(NULL, timeout); // leaves the event in the queue for events()
+    }
+
+    uint64_t ts_start = now_ns();
     events();
-    clock_gettime(CLOCK_REALTIME, &ts_events);
+    uint64_t ts_events = now_ns();
     loop();
-    clock_gettime(CLOCK_REALTIME, &ts_loop);
-    render();
-    clock_gettime(CLOCK_REALTIME, &ts_render);
-/*
-    if (loopcount%100==0){
-      
+    uint64_t ts_loop = now_ns();
+    stage_ns[STAGE_EVENTS] += ts_events - ts_start;
+    stage_ns[STAGE_LOOP] += ts_loop - ts_events;
+    if (!was_dirty && scene_dirty){
+      dirty_since = ts_loop;
+    }
+
+    if (running && scene_dirty && ms_until_next_frame() == 0){
+      render();
+      stage_ns[STAGE_RENDER] += now_ns() - ts_loop;
+      scene_dirty = false;
+      frame_done();
+      profile_frame_done();
     }
-*/
-/*
-    printf("events %u loop %u  render %u total %u\n", 
-      diff(ts_start, ts_events),
-      diff(ts_events, ts_loop),
-      diff(ts_loop, ts_render),
-      diff(ts_start, ts_render));
-*/
-    usleep(30000);
-    loopcount++;
   } 
 
+  if (autosave.running()){
+    save_snapshot();
+  }
+  if (late_frames){
+    printf("%d of %d frames were late\n", late_frames, frames);
+  }
+  if (profile_out){
+    print_profile_summary();
+  }
+  if (replay_filename){
+    print_replay_summary();
+  }
+  if (trace_out.f){
+    trace_out.close();
+    printf("board state %016llx\n", (unsigned long long)board_state_hash());
+  }
+
 
+  bool failed = load_failed; // quit() takes the puzzle down
   quit();
 
-  return 0;
+  return failed ? 1 : 0;
 };
@@ -0,0 +1,44 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+
+/*
+ * Number of threads to use for the parallel stages
+ */
+int worker_count() {
+    unsigned int n = std::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+/*
+ * Split [begin, end) into one contiguous band per worker and call
+ * f(band_begin, band_end) for every band on its own thread. Returns when all
+ * bands are done. With a single band f is called on the calling thread.
+ */
+template <typename F>
+void parallel_for_bands(int begin, int end, F f) {
+    int bands = std::min(worker_count(), end - begin);
+    if (bands <= 1) {
+        if (end > begin) {
+            f(begin, end);
+        }
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (int b = 0; b < bands; b++) {
+        int band_begin = begin + (long long)(end - begin) *  b      / bands;
+        int band_end   = begin + (long long)(end - begin) * (b + 1) / bands;
+        threads.push_back(std::thread(f, band_begin, band_end));
+    }
+    for (unsigned int i = 0; i < threads.size(); i++) {
+        threads[i].join();
+    }
+}
+
+
+#endif // PARALLEL_H
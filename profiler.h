@@ -0,0 +1,41 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+
+/*
+ * The last 'size' samples of a value (e.g the time of a stage per frame),
+ * older samples are overwritten. Percentiles are taken over the samples
+ * in the window, they cost a copy and a partial sort so only ask for them
+ * now and then (e.g when updating a display).
+ */
+struct rolling_stats {
+    std::vector<uint64_t> samples;
+    unsigned int next;  // where the next sample goes
+    unsigned int count; // samples in the window
+
+    rolling_stats(unsigned int size = 256) : samples(size), next(0), count(0) {}
+
+    void add(uint64_t value) {
+        samples[next] = value;
+        next = (next + 1) % samples.size();
+        count = std::min(count + 1, (unsigned int)samples.size());
+    }
+
+    /* p in 0..100, 0 without samples */
+    uint64_t percentile(int p) const {
+        if (count == 0) {
+            return 0;
+        }
+        std::vector<uint64_t> sorted(samples.begin(), samples.begin() + count);
+        unsigned int k = std::min(count - 1, (unsigned int)((uint64_t)count * p / 100));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+    }
+};
+
+
+#endif // PROFILER_H
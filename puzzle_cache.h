@@ -0,0 +1,225 @@
+#ifndef PUZZLE_CACHE_H
+#define PUZZLE_CACHE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+
+
+/*
+ * On-disk cache of cut puzzles.
+ *
+ * A cache file holds everything init() derives from the photo: the filled
+ * label map and the pixels and hit mask of every piece. The hint outline is
+ * not kept, it is made from the seed again. It is laid out so it can be used straight from a memory
+ * mapping, every section starts at a multiple of puzzle_cache_align:
+ *
+ *   puzzle_cache_header
+ *   puzzle_cache_piece[num_pieces]   (label order, see piece_label())
+ *   labels                           width*height*label_size bytes
+ *   piece pixels and hit masks       at the offsets given per piece
+ *
+ * Files are written in host byte order, the masks in the header keep a
+ * file from another byte order from ever matching.
+ */
+const char puzzle_cache_magic[8] = {'P', 'P', 'U', 'Z', 'Z', 'L', 'E', 'C'};
+const uint32_t puzzle_cache_version = 3;
+const uint64_t puzzle_cache_align = 64;
+
+/*
+ * Everything the cut puzzle depends on. Two launches with equal keys make
+ * the same puzzle.
+ */
+struct puzzle_cache_key {
+    uint64_t image_hash; // see hash_file()
+    uint64_t image_size;
+    int32_t screen_width;
+    int32_t screen_height;
+    int32_t pieces_x;
+    int32_t pieces_y;
+    float boardsize_percent;
+    uint32_t seed;
+};
+
+struct puzzle_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    puzzle_cache_key key;
+    uint32_t rmask, gmask, bmask, amask; // of the piece pixels, 32 bits each
+    int32_t width;  // board size
+    int32_t height;
+    int32_t label_size;
+    int32_t reserved;
+    uint64_t pieces_offset;
+    uint64_t labels_offset;
+    uint64_t file_size;
+};
+
+struct puzzle_cache_piece {
+    int32_t image_x, image_y, image_w, image_h; // image_rect of the piece
+    int32_t pitch;          // bytes per row of the pixels
+    int32_t hit_mask_pitch; // bytes per row of the hit mask
+    uint64_t pixels_offset;
+    uint64_t hit_mask_offset;
+};
+
+inline uint64_t puzzle_cache_aligned(uint64_t offset) {
+    return (offset + puzzle_cache_align - 1) / puzzle_cache_align * puzzle_cache_align;
+}
+
+/*
+ * A whole file mapped into memory, private and writable so the pages can be
+ * handed to code that does not promise to leave them alone (written pages
+ * are copied, the file never changes).
+ */
+struct mapped_file {
+    uint8_t *data;
+    size_t size;
+
+    mapped_file() : data(0), size(0) {}
+
+    bool open(const char *filename) {
+        close();
+        int fd = ::open(filename, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            ::close(fd);
+            return false;
+        }
+        void *p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        data = (uint8_t*)p;
+        size = st.st_size;
+        return true;
+    }
+
+    void close() {
+        if (data) {
+            munmap(data, size);
+        }
+        data = 0;
+        size = 0;
+    }
+};
+
+/*
+ * 64 bit FNV-1a over the file contents, eight bytes at a time so hashing a
+ * big photo takes a few ms. 'size' is set to the file size. Returns false
+ * if the file can't be read.
+ */
+bool hash_file(const char *filename, uint64_t *hash, uint64_t *size) {
+    mapped_file f;
+    if (!f.open(filename)) {
+        return false;
+    }
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= f.size; i += 8) {
+        uint64_t word;
+        memcpy(&word, f.data + i, 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for (; i < f.size; i++) {
+        h = (h ^ f.data[i]) * 0x100000001b3ULL;
+    }
+    *hash = h;
+    *size = f.size;
+    f.close();
+    return true;
+}
+
+/*
+ * The cache directory: $XDG_CACHE_HOME/photopuzzle or ~/.cache/photopuzzle
+ */
+std::string default_puzzle_cache_dir() {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (xdg && *xdg) {
+        return std::string(xdg) + "/photopuzzle";
+    }
+    if (home && *home) {
+        return std::string(home) + "/.cache/photopuzzle";
+    }
+    return "";
+}
+
+/*
+ * Create the directory and any missing parents, like mkdir -p
+ */
+bool make_dirs(const std::string &path) {
+    for (size_t i = 1; i <= path.size(); i++) {
+        if (i == path.size() || path[i] == '/') {
+            std::string dir = path.substr(0, i);
+            if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * File name of the cache entry for 'key' within 'dir'
+ */
+std::string puzzle_cache_filename(const std::string &dir, const puzzle_cache_key &key) {
+    /* FNV-1a over the key fields, the full key is checked on reading */
+    const uint8_t *bytes[] = {(const uint8_t*)&key.image_hash, (const uint8_t*)&key.image_size,
+                              (const uint8_t*)&key.screen_width, (const uint8_t*)&key.screen_height,
+                              (const uint8_t*)&key.pieces_x, (const uint8_t*)&key.pieces_y,
+                              (const uint8_t*)&key.boardsize_percent, (const uint8_t*)&key.seed};
+    const size_t sizes[] = {8, 8, 4, 4, 4, 4, 4, 4};
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int k = 0; k < 8; k++) {
+        for (size_t i = 0; i < sizes[k]; i++) {
+            h = (h ^ bytes[k][i]) * 0x100000001b3ULL;
+        }
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.puzzle", (unsigned long long)h);
+    return dir + name;
+}
+
+bool same_puzzle_cache_key(const puzzle_cache_key &a, const puzzle_cache_key &b) {
+    return a.image_hash == b.image_hash &&
+           a.image_size == b.image_size &&
+           a.screen_width == b.screen_width &&
+           a.screen_height == b.screen_height &&
+           a.pieces_x == b.pieces_x &&
+           a.pieces_y == b.pieces_y &&
+           a.boardsize_percent == b.boardsize_percent &&
+           a.seed == b.seed;
+}
+
+/*
+ * Write 'size' bytes at 'offset', padding the file with zeros up to there
+ */
+bool write_at(FILE *f, uint64_t offset, const void *data, size_t size) {
+    long pos = ftell(f);
+    static const uint8_t zeros[puzzle_cache_align] = {0};
+    while (pos >= 0 && (uint64_t)pos < offset) {
+        size_t n = std::min((uint64_t)sizeof(zeros), offset - pos);
+        if (fwrite(zeros, 1, n, f) != n) {
+            return false;
+        }
+        pos += n;
+    }
+    return pos >= 0 && (uint64_t)pos == offset && fwrite(data, 1, size, f) == size;
+}
+
+
+#endif // PUZZLE_CACHE_H
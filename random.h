@@ -0,0 +1,35 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <stdint.h>
+
+
+/*
+ * Small pseudo random number generator (splitmix64) with independent
+ * streams. The numbers of a stream depend on the seed and the stream number
+ * only, so work split across threads draws the same numbers whatever thread
+ * it runs on.
+ */
+struct random_stream {
+    uint64_t state;
+
+    random_stream(uint64_t seed, uint64_t stream) {
+        state = seed;
+        state = next64() ^ (stream * 0xd1342543de82ef95ULL);
+    }
+
+    uint64_t next64() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    /* like rand(), 0..2^31-1 */
+    int next() {
+        return next64() >> 33;
+    }
+};
+
+
+#endif // RANDOM_H
@@ -0,0 +1,233 @@
+#ifndef REGION_FILL_H
+#define REGION_FILL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "label_map.h"
+#include "parallel.h"
+
+
+/*
+ * Fill the unlabelled ('none') pixels of a label map with the labels around
+ * them, by connected component labelling:
+ *
+ * 1. Every band of rows finds its runs of unlabelled pixels and joins runs
+ *    that touch the run above (4-connected) with union-find.
+ * 2. The runs in the first row of a band are joined to the last row of the
+ *    band above, giving the components of the whole map.
+ * 3. Every run votes with the label left of it, for runs at the left
+ *    border that is the last label above in the first column (starting
+ *    with 'first_label'). A component gets the label with at least 3/4 of
+ *    the votes of its runs. If there is no clear winner (a gap in a
+ *    boundary joined two regions) every run of the component takes the
+ *    label left of it instead, as the old row by row fill did, so a gap
+ *    never spreads further than that.
+ * 4. The bands write the labels of their runs.
+ *
+ * Rows are scanned a 64 bit word at a time, 'none' is all ones in every
+ * label type so a word of unlabelled pixels is ~0.
+ */
+struct label_run {
+    int x0, x1;     // [x0, x1)
+    uint32_t left;  // label left of the run, see fill_unlabelled()
+    int parent;     // union-find, index into all runs
+    uint32_t label; // the label written
+};
+
+inline int find_run_root(std::vector<label_run> &runs, int i) {
+    while (runs[i].parent != i) {
+        runs[i].parent = runs[runs[i].parent].parent; // path halving
+        i = runs[i].parent;
+    }
+    return i;
+}
+
+/* the smaller index becomes the root, so the result does not depend on the bands */
+inline void join_runs(std::vector<label_run> &runs, int a, int b) {
+    a = find_run_root(runs, a);
+    b = find_run_root(runs, b);
+    if (a < b) {
+        runs[b].parent = a;
+    } else if (b < a) {
+        runs[a].parent = b;
+    }
+}
+
+/*
+ * Index of the first pixel from i on that is (skip_none) or is not
+ * (!skip_none) labelled
+ */
+template <typename T>
+int skip_run(const T *row, int i, int w, T none, bool skip_none) {
+    const int lanes = 8 / sizeof(T);
+    const uint64_t lo = ~0ULL / (uint64_t)(T)~(T)0; // 1 in every lane
+    const uint64_t hi = lo << (sizeof(T) * 8 - 1);  // top bit of every lane
+
+    while (i < w) {
+        if (i + lanes <= w) {
+            uint64_t word;
+            memcpy(&word, row + i, 8);
+            uint64_t unlabelled = ~word; // lanes that are zero here are 'none'
+            bool any_none = ((unlabelled - lo) & ~unlabelled & hi) != 0;
+            if (skip_none ? word == ~0ULL : !any_none) {
+                i += lanes;
+                continue;
+            }
+        }
+        if ((row[i] == none) != skip_none) {
+            return i;
+        }
+        i++;
+    }
+    return w;
+}
+
+template <typename T>
+void fill_unlabelled(label_map &map, uint32_t first_label) {
+    const T none = map.none;
+    const int w = map.width;
+    const int h = map.height;
+    if (w <= 0 || h <= 0) {
+        return;
+    }
+
+    /* bands of rows, their runs and where each row starts in them */
+    int bands = std::max(1, std::min(worker_count(), h));
+    std::vector<int> band_begin(bands + 1);
+    for (int b = 0; b <= bands; b++) {
+        band_begin[b] = (long long)h * b / bands;
+    }
+    std::vector< std::vector<label_run> > band_runs(bands);
+    std::vector<int> row_start(h + 1); // index into the runs of its band
+
+    std::vector<uint32_t> border_label(h); // left of the first column
+    uint32_t carry = first_label;
+    for (int y = 0; y < h; y++) {
+        T label = map.row<T>(y)[0];
+        if (label != none) {
+            carry = label;
+        }
+        border_label[y] = carry;
+    }
+
+    parallel_for_bands(0, bands, [&](int first, int last) {
+        for (int b = first; b < last; b++) {
+            std::vector<label_run> &runs = band_runs[b];
+            int above_begin = 0, above_end = 0;
+            for (int y = band_begin[b]; y < band_begin[b + 1]; y++) {
+                const T *row = map.row<T>(y);
+                row_start[y] = runs.size();
+                int i = 0;
+                int k = above_begin;
+                while ((i = skip_run<T>(row, i, w, none, false)) < w) {
+                    label_run r;
+                    r.x0 = i;
+                    r.x1 = i = skip_run<T>(row, i, w, none, true);
+                    r.left = r.x0 > 0 ? row[r.x0 - 1] : border_label[y];
+                    r.parent = runs.size();
+                    r.label = map.none;
+                    runs.push_back(r);
+
+                    /* join the runs of the row above that overlap this one */
+                    while (k < above_end && runs[k].x1 <= r.x0) {
+                        k++;
+                    }
+                    for (int a = k; a < above_end && runs[a].x0 < r.x1; a++) {
+                        join_runs(runs, a, r.parent);
+                    }
+                }
+                above_begin = row_start[y];
+                above_end = runs.size();
+            }
+        }
+    });
+
+    /* all runs in one vector, in row order */
+    std::vector<label_run> runs;
+    std::vector<int> offset(bands + 1, 0);
+    for (int b = 0; b < bands; b++) {
+        offset[b + 1] = offset[b] + band_runs[b].size();
+    }
+    if (bands == 1) {
+        runs.swap(band_runs[0]);
+    }else{
+        runs.reserve(offset[bands]);
+        for (int b = 0; b < bands; b++) {
+            for (unsigned int i = 0; i < band_runs[b].size(); i++) {
+                label_run r = band_runs[b][i];
+                r.parent += offset[b];
+                runs.push_back(r);
+            }
+            std::vector<label_run>().swap(band_runs[b]);
+        }
+    }
+    for (int y = 0; y < h; y++) {
+        int b = std::upper_bound(band_begin.begin(), band_begin.end(), y) - band_begin.begin() - 1;
+        row_start[y] += offset[b];
+    }
+    row_start[h] = runs.size();
+
+    /* join across the band edges */
+    for (int b = 1; b < bands; b++) {
+        int y = band_begin[b];
+        int a = row_start[y - 1];
+        int a_end = row_start[y];
+        for (int i = row_start[y]; i < row_start[y + 1]; i++) {
+            while (a < a_end && runs[a].x1 <= runs[i].x0) {
+                a++;
+            }
+            for (int k = a; k < a_end && runs[k].x0 < runs[i].x1; k++) {
+                join_runs(runs, k, i);
+            }
+        }
+    }
+
+    /*
+     * Vote, Boyer-Moore majority first, then count the candidate. The votes
+     * are counted in the order of the runs, whatever the bands were.
+     */
+    struct ballot {
+        uint32_t candidate;
+        int lead;
+        int votes;
+        int total;
+    };
+    const int n = runs.size();
+    std::vector<ballot> ballots(n); // used at the roots only
+    for (int i = 0; i < n; i++) {
+        int root = runs[i].parent = find_run_root(runs, i); // roots come first, so this flattens all
+        ballot &b = ballots[root];
+        if (root == i) {
+            b.candidate = runs[i].left;
+            b.lead = b.votes = b.total = 0;
+        }
+        if (b.lead == 0) {
+            b.candidate = runs[i].left;
+        }
+        b.lead += b.candidate == runs[i].left ? 1 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        ballot &b = ballots[runs[i].parent];
+        b.total++;
+        b.votes += runs[i].left == b.candidate;
+    }
+    for (int i = 0; i < n; i++) {
+        const ballot &b = ballots[runs[i].parent];
+        runs[i].label = b.votes * 4 >= b.total * 3 ? b.candidate : runs[i].left;
+    }
+
+    parallel_for_bands(0, h, [&](int row_begin, int row_end) {
+        for (int y = row_begin; y < row_end; y++) {
+            T *row = map.row<T>(y);
+            for (int i = row_start[y]; i < row_start[y + 1]; i++) {
+                std::fill(row + runs[i].x0, row + runs[i].x1, (T)runs[i].label);
+            }
+        }
+    });
+}
+
+
+#endif // REGION_FILL_H
@@ -0,0 +1,262 @@
+#ifndef SAVE_GAME_H
+#define SAVE_GAME_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "puzzle_cache.h"
+
+
+/*
+ * Saved games.
+ *
+ * A game is saved as a snapshot plus a journal of the changes since:
+ *
+ *   <file>          save_header, then one save_piece per piece in render
+ *                   order, bottom first
+ *   <file>.journal  journal_header, then one save_piece per change, in the
+ *                   order they happened
+ *
+ * Restoring applies the snapshot and then replays the journal. Both carry a
+ * generation, a journal from another generation than the snapshot has
+ * already been folded into it and is ignored. So a crash while a new
+ * snapshot is written leaves either the old snapshot with its journal or
+ * the new one. An incomplete record at the end of the journal is dropped.
+ */
+const char save_magic[8] = {'P', 'P', 'U', 'Z', 'S', 'A', 'V', 'E'};
+const char journal_magic[8] = {'P', 'P', 'U', 'Z', 'J', 'R', 'N', 'L'};
+const uint32_t save_version = 1;
+
+struct save_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t generation;
+    puzzle_cache_key key; // the puzzle the game is played with
+    uint32_t num_pieces;
+    uint32_t reserved;
+};
+
+struct journal_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t generation;
+};
+
+struct save_piece {
+    uint32_t label;    // see piece_label()
+    int32_t x;         // current_pos
+    int32_t y;
+    uint16_t rotation; // current_rotation
+    uint8_t raised;    // journal only, the piece was put on top of all others
+    uint8_t reserved;
+};
+
+/*
+ * Writes snapshots and journal records on a thread of its own, so saving
+ * never waits for the disk. append() and snapshot() only queue the data.
+ */
+struct save_writer {
+    std::string filename;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::vector<save_piece> records;   // queued for the journal
+    std::vector<uint8_t> next_snapshot; // queued snapshot, whole file
+    std::vector<save_piece> snapshot_records; // queued before it, for the old journal if it can't be written
+    bool snapshot_queued;
+    bool stopping;
+    uint32_t generation;
+    FILE *journal;
+
+    save_writer() : snapshot_queued(false), stopping(false), generation(0), journal(0) {}
+
+    bool running() const {
+        return thread.joinable();
+    }
+
+    /*
+     * Start saving to 'file', restored at 'current_generation' (0 if there
+     * is no snapshot yet). Its journal goes on until the next snapshot.
+     */
+    void start(const std::string &file, uint32_t current_generation) {
+        filename = file;
+        generation = current_generation;
+        stopping = false;
+        if (generation > 0) {
+            open_journal(true);
+        }
+        thread = std::thread(&save_writer::run, this);
+    }
+
+    /* write everything still queued and stop the thread */
+    void stop() {
+        if (!running()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        thread.join();
+        if (journal) {
+            fclose(journal);
+            journal = 0;
+        }
+    }
+
+    void append(const save_piece &record) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            records.push_back(record);
+        }
+        wake.notify_one();
+    }
+
+    /*
+     * Replace the saved game with 'data', a complete snapshot file. The
+     * records queued so far are part of it, they are only written if the
+     * snapshot can't be.
+     */
+    void snapshot(std::vector<uint8_t> &data) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            next_snapshot.swap(data);
+            snapshot_queued = true;
+            snapshot_records.insert(snapshot_records.end(), records.begin(), records.end());
+            records.clear();
+        }
+        wake.notify_one();
+    }
+
+    void run() {
+        std::vector<save_piece> todo;
+        std::vector<save_piece> snapshot_todo;
+        std::vector<uint8_t> snapshot_data;
+
+        for (;;) {
+            bool write_snapshot;
+            bool done;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [this]{ return stopping || snapshot_queued || !records.empty(); });
+                write_snapshot = snapshot_queued;
+                snapshot_queued = false;
+                snapshot_data.swap(next_snapshot);
+                snapshot_todo.swap(snapshot_records);
+                todo.swap(records);
+                done = stopping;
+            }
+
+            if (write_snapshot && !write_snapshot_file(snapshot_data) && !snapshot_todo.empty()) {
+                write_records(snapshot_todo); // the old journal goes on
+            }
+            snapshot_todo.clear();
+            if (!todo.empty()) {
+                write_records(todo);
+                todo.clear();
+            }
+            if (done) {
+                return;
+            }
+        }
+    }
+
+    /*
+     * The new snapshot gets the next generation, then a new journal is
+     * started for it. False if the snapshot could not be written, the old
+     * snapshot and journal stay in use.
+     */
+    bool write_snapshot_file(std::vector<uint8_t> &data) {
+        generation++;
+        ((save_header*)&data[0])->generation = generation;
+
+        std::string tmp = filename + ".tmp";
+        FILE *f = fopen(tmp.c_str(), "wb");
+        bool ok = f && fwrite(&data[0], 1, data.size(), f) == data.size();
+        ok = f && fflush(f) == 0 && fdatasync(fileno(f)) == 0 && ok;
+        ok = f && fclose(f) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), filename.c_str()) != 0) {
+            printf("Couldn't save the game to %s\n", filename.c_str());
+            unlink(tmp.c_str());
+            generation--;
+            return false;
+        }
+
+        open_journal(false);
+        return true;
+    }
+
+    /*
+     * Open the journal of the current generation. With 'keep' an existing
+     * journal of this generation is kept and written on after its last
+     * complete record, otherwise a new one is started.
+     */
+    void open_journal(bool keep) {
+        if (journal) {
+            fclose(journal);
+        }
+        std::string journal_filename = filename + ".journal";
+        if (keep && (journal = fopen(journal_filename.c_str(), "r+b")) != NULL) {
+            journal_header h;
+            long size = 0;
+            if (fread(&h, sizeof(h), 1, journal) == 1 &&
+                memcmp(h.magic, journal_magic, sizeof(h.magic)) == 0 &&
+                h.version == save_version && h.generation == generation &&
+                fseek(journal, 0, SEEK_END) == 0 && (size = ftell(journal)) >= (long)sizeof(h)) {
+                size -= (size - sizeof(h)) % sizeof(save_piece);
+                if (ftruncate(fileno(journal), size) == 0 && fseek(journal, size, SEEK_SET) == 0) {
+                    return;
+                }
+            }
+            fclose(journal);
+        }
+
+        journal_header h;
+        memcpy(h.magic, journal_magic, sizeof(h.magic));
+        h.version = save_version;
+        h.generation = generation;
+        if ((journal = fopen(journal_filename.c_str(), "wb")) == NULL ||
+            fwrite(&h, sizeof(h), 1, journal) != 1) {
+            printf("Couldn't write the journal %s\n", journal_filename.c_str());
+        }
+    }
+
+    void write_records(const std::vector<save_piece> &todo) {
+        if (!journal) {
+            return; // there is no snapshot yet, the next one will have it all
+        }
+        fwrite(&todo[0], sizeof(save_piece), todo.size(), journal);
+        fflush(journal);
+        fdatasync(fileno(journal));
+    }
+};
+
+/*
+ * Read a whole file, false if it can't be read
+ */
+bool read_file(const std::string &filename, std::vector<uint8_t> &data) {
+    FILE *f = fopen(filename.c_str(), "rb");
+    if (!f) {
+        return false;
+    }
+    uint8_t buffer[65536];
+    size_t n;
+    data.clear();
+    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+        data.insert(data.end(), buffer, buffer + n);
+    }
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok;
+}
+
+
+#endif // SAVE_GAME_H
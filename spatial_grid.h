@@ -0,0 +1,105 @@
+#ifndef SPATIAL_GRID_H
+#define SPATIAL_GRID_H
+
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <vector>
+
+
+/*
+ * Uniform grid over an area, every cell lists the items whose rect overlaps
+ * it. Finding the candidates at a point is a lookup of a single cell, moving
+ * an item only touches the cells it enters or leaves.
+ *
+ * Rects (partly) outside of the area are clamped to the border cells.
+ */
+template <typename T>
+struct spatial_grid {
+    int cell_w;
+    int cell_h;
+    int cols;
+    int rows;
+    std::vector< std::vector<T> > cells;
+
+    spatial_grid() : cell_w(1), cell_h(1), cols(0), rows(0) {}
+
+    void init(int area_w, int area_h, int cell_width, int cell_height) {
+        cell_w = std::max(1, cell_width);
+        cell_h = std::max(1, cell_height);
+        cols = std::max(1, (area_w + cell_w - 1) / cell_w);
+        rows = std::max(1, (area_h + cell_h - 1) / cell_h);
+        cells.assign(cols * rows, std::vector<T>());
+    }
+
+    void insert(T item, const SDL_Rect &r) {
+        int c0, r0, c1, r1;
+        cell_range(r, c0, r0, c1, r1);
+        for (int row = r0; row <= r1; row++) {
+            for (int col = c0; col <= c1; col++) {
+                cells[row * cols + col].push_back(item);
+            }
+        }
+    }
+
+    void remove(T item, const SDL_Rect &r) {
+        int c0, r0, c1, r1;
+        cell_range(r, c0, r0, c1, r1);
+        for (int row = r0; row <= r1; row++) {
+            for (int col = c0; col <= c1; col++) {
+                remove_from_cell(item, row * cols + col);
+            }
+        }
+    }
+
+    void move(T item, const SDL_Rect &from, const SDL_Rect &to) {
+        int fc0, fr0, fc1, fr1;
+        int tc0, tr0, tc1, tr1;
+        cell_range(from, fc0, fr0, fc1, fr1);
+        cell_range(to,   tc0, tr0, tc1, tr1);
+        if (fc0 == tc0 && fr0 == tr0 && fc1 == tc1 && fr1 == tr1) {
+            return; // still in the same cells
+        }
+        for (int row = fr0; row <= fr1; row++) {
+            for (int col = fc0; col <= fc1; col++) {
+                if (col < tc0 || col > tc1 || row < tr0 || row > tr1) {
+                    remove_from_cell(item, row * cols + col);
+                }
+            }
+        }
+        for (int row = tr0; row <= tr1; row++) {
+            for (int col = tc0; col <= tc1; col++) {
+                if (col < fc0 || col > fc1 || row < fr0 || row > fr1) {
+                    cells[row * cols + col].push_back(item);
+                }
+            }
+        }
+    }
+
+    /* items whose rect may contain the point x,y */
+    const std::vector<T> &at(int x, int y) const {
+        int col = std::min(std::max(x / cell_w, 0), cols - 1);
+        int row = std::min(std::max(y / cell_h, 0), rows - 1);
+        return cells[row * cols + col];
+    }
+
+    void cell_range(const SDL_Rect &r, int &c0, int &r0, int &c1, int &r1) const {
+        c0 = std::min(std::max(r.x / cell_w, 0), cols - 1);
+        r0 = std::min(std::max(r.y / cell_h, 0), rows - 1);
+        c1 = std::min(std::max((r.x + r.w) / cell_w, 0), cols - 1);
+        r1 = std::min(std::max((r.y + r.h) / cell_h, 0), rows - 1);
+    }
+
+    void remove_from_cell(T item, int cell) {
+        std::vector<T> &v = cells[cell];
+        for (unsigned int i = 0; i < v.size(); i++) {
+            if (v[i] == item) {
+                v[i] = v.back();
+                v.pop_back();
+                return;
+            }
+        }
+    }
+};
+
+
+#endif // SPATIAL_GRID_H
@@ -0,0 +1,49 @@
+#ifndef UNION_FIND_H
+#define UNION_FIND_H
+
+#include <utility>
+#include <vector>
+
+
+/*
+ * Disjoint sets over the items 0..n-1, with union by size and path halving
+ * so find() and join() take nearly constant time.
+ */
+struct union_find {
+    std::vector<int> parent;
+    std::vector<int> size; // of the set, valid at the roots only
+
+    void init(int n) {
+        parent.resize(n);
+        size.assign(n, 1);
+        for (int i = 0; i < n; i++) {
+            parent[i] = i;
+        }
+    }
+
+    int find(int i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    /* merge the sets of a and b, returns the root of the merged set */
+    int join(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a == b) {
+            return a;
+        }
+        if (size[a] < size[b]) {
+            std::swap(a, b);
+        }
+        parent[b] = a;
+        size[a] += size[b];
+        return a;
+    }
+};
+
+
+#endif // UNION_FIND_H
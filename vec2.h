@@ -22,21 +22,57 @@ vec2 operator * (float s, vec2 a) {
 }
 
 
-vec2 getBezierPoint( vec2* points, int numPoints, float t ) { 
-    vec2* tmp = new vec2[numPoints];
-    memcpy(tmp, points, numPoints * sizeof(vec2));
-    int i = numPoints - 1;
-    while (i > 0) {
-        for (int k = 0; k < i; k++)
-            tmp[k] = tmp[k] + t * ( tmp[k+1] - tmp[k] );
-        i--;
-    }   
-    vec2 answer = tmp[0];
-    delete[] tmp;
-    return answer;
-}
+/*
+ * Bezier curve with a fixed number of control points (Degree+1), evaluated
+ * in closed form. The control points are converted once to the power basis,
+ * B(t) = c[0] + c[1]*t + ... + c[Degree]*t^Degree, so evaluating a point is
+ * a Horner loop with no temporary storage at all.
+ */
+template <int Degree>
+struct bezier {
+    float cx[Degree+1];
+    float cy[Degree+1];
+
+    bezier(const vec2 *points) {
+        /* c[j] = binomial(Degree, j) * sum_i (-1)^(j-i) * binomial(j, i) * points[i] */
+        float binomial_n = 1;
+        for (int j = 0; j <= Degree; j++) {
+            float x = 0, y = 0;
+            float binomial_j = 1;
+            for (int i = 0; i <= j; i++) {
+                float sign = ((j - i) % 2) ? -1 : 1;
+                x += sign * binomial_j * points[i].x;
+                y += sign * binomial_j * points[i].y;
+                binomial_j = binomial_j * (j - i) / (i + 1);
+            }
+            cx[j] = binomial_n * x;
+            cy[j] = binomial_n * y;
+            binomial_n = binomial_n * (Degree - j) / (j + 1);
+        }
+    }
 
+    vec2 point(float t) const {
+        float x = cx[Degree];
+        float y = cy[Degree];
+        for (int k = Degree - 1; k >= 0; k--) {
+            x = x * t + cx[k];
+            y = y * t + cy[k];
+        }
+        return vec2(x, y);
+    }
 
+    /*
+     * Fill 'out' with 'count' points evenly spaced in t, t = i/count, i.e
+     * the end point (t=1) itself is not included. Every sample is
+     * independent of the others so the loop can be vectorized across t.
+     */
+    void points(vec2 *out, int count) const {
+        const float dt = 1.0f / count;
+        for (int i = 0; i < count; i++) {
+            out[i] = point(i * dt);
+        }
+    }
+};
 
 
 #endif // VEC2_H